@@ -0,0 +1,292 @@
+#include "kaleidoscope/compiler/Arena.hpp"
+#include "kaleidoscope/compiler/Engine.hpp"
+#include "kaleidoscope/compiler/Lexer.hpp"
+#include "kaleidoscope/compiler/Parser.hpp"
+#include "kaleidoscope/compiler/Token.hpp"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Micro benchmarks of the lexer, parser, codegen and jit, and macro benchmarks
+// running the Repl over a generated corpus of scripts. Results are written as
+// one JSON object:
+//
+//   {"micro": {"<benchmark>": {"<rate>": ..., "seconds": ...}, ...},
+//    "macro": {"<script>": {"<mode>": <seconds>, ...}, ...}}
+//
+// Rates are per second of wall time, and macro times the best of a few runs.
+
+using namespace llvm;
+
+static cl::opt<std::string> repl_path(cl::Positional, cl::desc("<repl>"),
+                                      cl::Required);
+
+static cl::opt<std::string>
+    corpus_dir(cl::Positional, cl::desc("<corpus directory>"), cl::Required);
+
+static cl::opt<std::string> output("output", cl::desc("Write results here"),
+                                   cl::value_desc("filename"), cl::init("-"));
+
+static cl::opt<double>
+    min_seconds("min-seconds",
+                cl::desc("How long to repeat each micro benchmark for"),
+                cl::init(0.25));
+
+static cl::opt<unsigned>
+    macro_runs("macro-runs", cl::desc("Runs of each macro benchmark"),
+               cl::init(3));
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// repeat f, which returns how many units it processed, for min_seconds.
+// returns {units per second, seconds per call}.
+static std::pair<double, double> measure(std::function<size_t()> const &f) {
+  size_t units = 0, calls = 0;
+  auto start = Clock::now();
+  double elapsed;
+  do {
+    units += f();
+    ++calls;
+    elapsed = seconds_since(start);
+  } while (elapsed < min_seconds);
+  return {units / elapsed, elapsed / calls};
+}
+
+// a script of many small definitions and externs, like real code
+static std::string synthetic_source(unsigned definitions) {
+  std::string source;
+  for (unsigned i = 0; i < definitions; ++i) {
+    auto n = std::to_string(i);
+    auto callee = std::to_string(i ? i - 1 : 0);
+    source += "def f" + n + "(x y) if x < y then x * " + n +
+              ".5 + y else (y - x) * f" + callee + "(x, y);\n";
+    source += "extern g" + n + "(a b);\n";
+  }
+  return source;
+}
+
+// ((1 + 1) + 1) ..., nested depth times
+static std::string deep_expression(unsigned depth) {
+  std::string source(depth, '(');
+  source += "1";
+  for (unsigned i = 0; i < depth; ++i)
+    source += " + 1)";
+  return source + ";\n";
+}
+
+// def wide(x) x * 1 + x * 2 - ..., with terms terms
+static std::string wide_definition(unsigned terms) {
+  std::string source = "def wide(x) x";
+  for (unsigned i = 1; i < terms; ++i)
+    source += (i % 2 ? " + x * " : " - x * ") + std::to_string(i);
+  return source + ";\n";
+}
+
+// parse every statement of source, returning how many nodes they came to
+static size_t parse_all(std::string const &source) {
+  Lexer lexer(source);
+  Parser parser;
+  size_t nodes = 0;
+  for (;;) {
+    ast::Arena arena;
+    if (!parser.parse(lexer, arena))
+      return nodes;
+    nodes += arena.size();
+  }
+}
+
+static void micro(json::OStream &json) {
+  auto result = [&](char const *name, char const *rate,
+                    std::pair<double, double> measured) {
+    json.attributeObject(name, [&] {
+      json.attribute(rate, measured.first);
+      json.attribute("seconds", measured.second);
+    });
+  };
+
+  auto source = synthetic_source(2000);
+  result("token_stream", "tokens_per_second", measure([&] {
+           std::istringstream input(source);
+           Token token;
+           size_t tokens = 0;
+           while (input >> token, token.type != Token::TypeEOF)
+             ++tokens;
+           return tokens;
+         }));
+  result("lexer", "tokens_per_second", measure([&] {
+           Lexer lexer(source);
+           size_t tokens = 0;
+           while (lexer.next().type != Token::TypeEOF)
+             ++tokens;
+           return tokens;
+         }));
+
+  auto deep = deep_expression(2000);
+  auto wide = wide_definition(20000);
+  result("parse_definitions", "nodes_per_second",
+         measure([&] { return parse_all(source); }));
+  result("parse_deep", "nodes_per_second",
+         measure([&] { return parse_all(deep); }));
+  result("parse_wide", "nodes_per_second",
+         measure([&] { return parse_all(wide); }));
+
+  // codegen of one statement, into a module of its own each time
+  auto codegen = [](std::string const &statement) {
+    return [statement] {
+      Lexer lexer(statement);
+      Parser parser;
+      ast::Arena arena;
+      auto tree = parser.parse(lexer, arena);
+      SignatureTable signatures;
+      CodegenContext ctx(DataLayout(""), &signatures);
+      auto f = cast<llvm::Function>(tree->codegen(ctx));
+      return size_t(f->getInstructionCount());
+    };
+  };
+  result("codegen_wide", "instructions_per_second",
+         measure(codegen(wide_definition(2000))));
+  result("codegen_loop", "instructions_per_second",
+         measure(codegen("def loops(n) for i = 0, i < n in "
+                         "for j = 0, j < i in if j < 5 then i * j else "
+                         "loops(j - 1);\n")));
+
+  // a definition compiled, looked up and called, at -O0 and -O2
+  for (unsigned level : {0u, 2u}) {
+    ExitOnError ExitOnErr("jit benchmark: ");
+    auto engine = ExitOnErr(Engine::create(level));
+    auto measured = measure([&] {
+      auto handle = ExitOnErr(engine->compile(
+          "def f(x y) if x < y then x * y + 1 else f(x - y, y);"));
+      auto f = ExitOnErr(engine->lookup<double(double, double)>("f"));
+      return size_t(f(3, 4) == 13);
+    });
+    json.attributeObject(level ? "jit_statement_O2" : "jit_statement_O0", [&] {
+      json.attribute("statements_per_second", measured.first);
+      json.attribute("seconds", measured.second);
+    });
+  }
+}
+
+struct Script {
+  char const *name;
+  std::string source;
+};
+
+static std::vector<Script> corpus() {
+  std::string fib = "def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);\n"
+                    "fib(30);\n";
+
+  std::string loops = "def cell(i j) i * j - j;\n"
+                      "def row(i n) for j = 0, j < n in cell(i, j);\n"
+                      "def grid(n) for i = 0, i < n in row(i, n);\n"
+                      "grid(1500);\n";
+
+  std::string definitions = synthetic_source(1000) + "f999(1, 2);\n";
+
+  // everything at once, redefinitions included
+  std::string mixed = fib + loops;
+  for (unsigned i = 0; i < 200; ++i) {
+    auto n = std::to_string(i);
+    mixed += "def step(x) x + " + n + ";\nstep(" + n + ") + fib(10);\n";
+  }
+  mixed += deep_expression(500);
+
+  return {{"fib", fib},
+          {"loops", loops},
+          {"definitions", definitions},
+          {"mixed", mixed}};
+}
+
+static void macro(json::OStream &json) {
+  struct Mode {
+    char const *name;
+    std::vector<StringRef> options;
+  };
+  Mode const modes[] = {
+      {"O0", {}},
+      {"O2", {"-O2"}},
+      {"batch_O2", {"--batch", "-O2"}},
+      {"lazy_O2", {"--lazy", "-O2"}},
+  };
+
+  ExitOnError ExitOnErr("corpus: ");
+  if (auto ec = sys::fs::create_directories(corpus_dir))
+    ExitOnErr(errorCodeToError(ec));
+
+  for (auto &script : corpus()) {
+    SmallString<128> path(corpus_dir.getValue());
+    sys::path::append(path, std::string(script.name) + ".ks");
+    {
+      std::error_code ec;
+      raw_fd_ostream out(path, ec);
+      if (ec)
+        ExitOnErr(errorCodeToError(ec));
+      out << script.source;
+    }
+
+    json.attributeObject(script.name, [&] {
+      for (auto &mode : modes) {
+        std::vector<StringRef> args = {repl_path};
+        args.insert(args.end(), mode.options.begin(), mode.options.end());
+        args.push_back(path);
+        // results go to stderr, which isn't what's being measured
+        std::optional<StringRef> redirects[] = {std::nullopt, std::nullopt,
+                                                StringRef("")};
+
+        std::optional<double> best;
+        for (unsigned run = 0; run < macro_runs; ++run) {
+          auto start = Clock::now();
+          std::string message;
+          if (sys::ExecuteAndWait(repl_path, args, std::nullopt, redirects, 0,
+                                  0, &message) != 0) {
+            errs() << script.name << " failed with " << mode.name << ": "
+                   << message << '\n';
+            best.reset();
+            break;
+          }
+          auto elapsed = seconds_since(start);
+          best = best ? std::min(*best, elapsed) : elapsed;
+        }
+        if (best)
+          json.attribute(mode.name, *best);
+        else
+          json.attribute(mode.name, nullptr);
+      }
+    });
+  }
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope benchmarks\n");
+
+  std::error_code ec;
+  raw_fd_ostream out(output, ec, sys::fs::OF_Text);
+  if (ec) {
+    errs() << "Failed to open " << output << ": " << ec.message() << ".\n";
+    return 1;
+  }
+
+  json::OStream json(out, 2);
+  json.objectBegin();
+  json.attributeObject("micro", [&] { micro(json); });
+  json.attributeObject("macro", [&] { macro(json); });
+  json.objectEnd();
+  out << '\n';
+  return 0;
+}
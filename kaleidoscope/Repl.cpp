@@ -1,5 +1,22 @@
+#include "compiler/LazyDefinitions.hpp"
+#include "compiler/ObjectCache.hpp"
+#include "compiler/ObjectEmitter.hpp"
+#include "compiler/Optimizer.hpp"
+#include "compiler/Bytecode.hpp"
+#include "compiler/Channel.hpp"
+#include "compiler/ContextPool.hpp"
+#include "compiler/Interpreter.hpp"
+#include "compiler/Lexer.hpp"
 #include "compiler/Parser.hpp"
+#include "compiler/Profiler.hpp"
+#include "compiler/Runtime.hpp"
+#include "compiler/Symbol.hpp"
+#include "compiler/Tiers.hpp"
+#include "compiler/TimeReport.hpp"
 #include "compiler/Token.hpp"
+#include "compiler/WorkStealing.hpp"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
@@ -9,53 +26,630 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
-#include <fstream>
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+#include <condition_variable>
+#include <future>
 #include <iostream>
 #include <istream>
 #include <llvm/ADT/StringMapEntry.h>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 
 using namespace llvm;
 using namespace llvm::orc;
+
+static cl::opt<std::string> script_path(cl::Positional, cl::desc("[SCRIPT]"),
+                                        cl::init(""));
+
+static cl::opt<unsigned> opt_level("O", cl::desc("Optimization level (0-3)"),
+                                   cl::Prefix, cl::init(0));
+
+static cl::opt<unsigned>
+    compile_threads("threads",
+                    cl::desc("Number of jit compile threads (default: one "
+                             "per core)"),
+                    cl::init(std::thread::hardware_concurrency()));
+
+static cl::opt<bool>
+    batch("batch", cl::desc("Compile the whole script before running it"));
+
+static cl::opt<bool>
+    lazy("lazy", cl::desc("Compile each function the first time it is called"));
+
+static cl::opt<bool>
+    tiered("tiered", cl::desc("Compile functions lazily, then recompile the "
+                              "ones called often at -O3"));
+
+static cl::opt<bool> interpret(
+    "interpret",
+    cl::desc("Run a script as bytecode, and jit the functions called often"));
+
+static cl::opt<unsigned>
+    tier_threshold("tier-threshold",
+                   cl::desc("Calls before a function is recompiled at -O3 "
+                            "with --tiered, or jitted with --interpret"),
+                   cl::init(1000));
+
+static cl::opt<unsigned>
+    parse_threads("parse-threads",
+                  cl::desc("Parse scripts on this many threads at once "
+                           "(default: 1)"),
+                  cl::init(1));
+
+static cl::opt<unsigned>
+    eval_threads("eval-threads",
+                 cl::desc("Evaluate top level expressions on this many "
+                          "threads at once with --batch (default: 1)"),
+                 cl::init(1));
+
+static cl::opt<bool>
+    simplify_ast("simplify",
+                 cl::desc("Fold constants and drop identity operations in the "
+                          "syntax tree before generating code (default: on)"),
+                 cl::init(true));
+
+static cl::opt<bool> share_contexts(
+    "share-contexts",
+    cl::desc("Generate statements into a few shared LLVM contexts, one per "
+             "compile thread, instead of one each"));
+
+static cl::opt<std::string>
+    cache_dir("cache-dir",
+              cl::desc("Reuse compiled objects cached in this directory"),
+              cl::value_desc("directory"));
+
+static cl::opt<std::string>
+    emit_obj("emit-obj", cl::desc("Write the script's functions to an object "
+                                  "file instead of running it"),
+             cl::value_desc("filename"));
+
+static cl::opt<std::string>
+    emit_shared("emit-shared",
+                cl::desc("Link the script's functions into a shared library "
+                         "instead of running it"),
+                cl::value_desc("filename"));
+
+static cl::opt<bool>
+    dump_ir("dump-ir", cl::desc("Print each statement's IR as generated "
+                                "(default: only without a script)"));
+
+static cl::opt<bool>
+    dump_asm("dump-asm",
+             cl::desc("Print the assembly each module is compiled to"));
+
+static cl::opt<bool>
+    dump_ast("dump-ast",
+             cl::desc("Print each statement as parsed and simplified"));
+
+static cl::opt<std::string>
+    dump_file("dump-file",
+              cl::desc("Write what --dump-* prints to a file instead of "
+                       "stderr"),
+              cl::value_desc("filename"));
+
+static cl::opt<bool>
+    time_report("time-report",
+                cl::desc("Print the time spent in each phase of the run, "
+                         "and in LLVM's passes, when it ends"));
+
+static cl::opt<bool>
+    gdb("gdb", cl::desc("Register jitted code with GDB's JIT interface"));
+
+static cl::opt<bool>
+    perf("perf", cl::desc("Write jitted functions to /tmp/perf-<pid>.map, "
+                          "and a jitdump file where LLVM supports it"));
+
+static cl::opt<bool>
+    profile("profile",
+            cl::desc("Sample where the run spends its time, and add the time "
+                     "in each jitted function to the --time-report"));
+
+static cl::opt<bool>
+    time_report_json("time-report-json",
+                     cl::desc("Print the --time-report as JSON"));
+
+// Where --dump-* and --time-report output goes. Dumps come from the compile
+// threads as well as the main one, so each is written whole under a lock. The
+// stream is buffered; on stderr it's flushed after each dump, to come out in
+// order with results and errors.
+class Dumps {
+  std::mutex mutex;
+  std::unique_ptr<raw_fd_ostream> out;
+  bool to_stderr = true;
+
+public:
+  // to stderr if path is empty. false after reporting why path can't be
+  // written.
+  bool open(StringRef path) {
+    if (path.empty()) {
+      out = std::make_unique<raw_fd_ostream>(2, false);
+      return true;
+    }
+    std::error_code ec;
+    out = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+    to_stderr = false;
+    if (ec)
+      std::cerr << "Failed to open " << path.str() << ": " << ec.message()
+                << ".\n";
+    return !ec;
+  }
+
+  // for printing to stderr without splitting a dump
+  std::unique_lock<std::mutex> lock() {
+    return std::unique_lock<std::mutex>(mutex);
+  }
+
+  template <typename F> void write(F &&print) {
+    auto locked = lock();
+    print(*out);
+    if (to_stderr)
+      out->flush();
+  }
+};
+
+static Dumps dumps;
+
+// print a statement as parsed and simplified with --dump-ast
+static void dump_statement(ast::Expr const &ast) {
+  if (dump_ast)
+    dumps.write([&](raw_ostream &out) {
+      ast.print(out);
+      out << ";\n";
+    });
+}
+
+// print generated IR if asked to, or by default at the prompt
+static void dump_code(Value const &code, bool interactive) {
+  if (dump_ir.getNumOccurrences() ? dump_ir : interactive)
+    dumps.write([&](raw_ostream &out) {
+      code.print(out);
+      out << '\n';
+    });
+}
+
+// print module's assembly with --dump-asm. the jit compiles with a target
+// machine of its own, so this compiles a copy with another one.
+static void dump_assembly(Module const &module) {
+  if (!dump_asm)
+    return;
+  auto tm = create_host_target_machine(opt_level);
+  SmallString<0> assembly;
+  raw_svector_ostream out(assembly);
+  auto err = tm ? emit_assembly(*CloneModule(module), **tm, out)
+                : tm.takeError();
+  dumps.write([&](raw_ostream &dump) {
+    if (err)
+      dump << "Failed to print assembly: " << toString(std::move(err))
+           << '\n';
+    else
+      dump << assembly;
+  });
+}
+
+// Removes a definition's body when it's replaced. Its stubs stay.
 class ResourceTrackerManager {
   ResourceTrackerSP rt;
+  // or a tiered definition's versions
+  std::unique_ptr<Tiers::Definition> tiered;
 
 public:
   ResourceTrackerManager(ResourceTrackerSP rt) : rt(rt) {}
-  ~ResourceTrackerManager() { ExitOnError()(rt->remove()); }
+  ResourceTrackerManager(std::unique_ptr<Tiers::Definition> tiered)
+      : tiered(std::move(tiered)) {}
+  ~ResourceTrackerManager() {
+    if (rt)
+      ExitOnError()(rt->remove());
+  }
+};
+
+// Which definitions call each function. They call it through its stub, so it
+// can be redefined under them as long as it keeps its number of arguments.
+class Callers {
+  DenseMap<Symbol, DenseSet<Symbol>> callers;
+  DenseMap<Symbol, std::vector<Symbol>> callees;
+
+public:
+  // record what the definition of name in module calls, instead of what the
+  // last one did
+  void define(Symbol name, Module const &module) {
+    auto &calls = callees[name];
+    for (auto callee : calls)
+      callers[callee].erase(name);
+    calls.clear();
+
+    for (auto &f : module.functions()) {
+      auto callee = Symbol::intern(f.getName());
+      if (!f.isDeclaration() || callee == name)
+        continue;
+      calls.push_back(callee);
+      callers[callee].insert(name);
+    }
+  }
+
+  // whether a definition or extern can replace the function of the same name,
+  // reporting to errors if it can't
+  bool allows(ast::Prototype const &prototype,
+              SignatureTable const &signatures, std::ostream &errors) const {
+    auto name = prototype.get_name();
+    auto old = signatures.find(name);
+    auto users = callers.find(name);
+    if (old == signatures.end() || users == callers.end() ||
+        users->second.empty() ||
+        old->second == prototype.get_signature())
+      return true;
+
+    errors << "Can't change the arguments " << name.str().str()
+           << " takes while " << (*users->second.begin()).str().str()
+           << " calls it.\n";
+    return false;
+  }
+};
+
+// what the parser names top level expressions
+static Symbol const anon_expr = Symbol::intern("__anon_expr");
+
+// has to outlive the jit it is installed on
+static std::unique_ptr<DiskObjectCache> object_cache;
+
+// with --gdb, --perf or --profile. has to outlive the jit, and is stopped
+// before the time report.
+static std::unique_ptr<Profiler> profiler;
+
+// where the REPL and pipeline put definitions, and batch mode with --lazy or
+// --tiered. this, contexts and tiers are released before the jit is destroyed.
+static std::unique_ptr<LazyDefinitions> definitions;
+
+// where statements are generated
+static std::unique_ptr<ContextPool> contexts;
+
+// with --tiered. reset before the definitions are removed, to stop recompiling.
+static std::unique_ptr<Tiers> tiers;
+
+std::unique_ptr<LLJIT> create_jit() {
+  ExitOnError ExitOnErr;
+  LLJITBuilder builder;
+  builder.setNumCompileThreads(compile_threads);
+
+  if (!cache_dir.empty()) {
+    object_cache = std::make_unique<DiskObjectCache>(cache_dir, opt_level);
+    object_cache->install(builder);
+  }
+
+  if (gdb || perf || profile) {
+    profiler =
+        std::make_unique<Profiler>(Profiler::Options{gdb, perf, profile});
+    profiler->install(builder);
+  }
+
+  auto jit = ExitOnErr(builder.create());
+  if (profiler)
+    profiler->start();
+  contexts = std::make_unique<ContextPool>(
+      share_contexts ? std::max(1u, unsigned(compile_threads)) : 0);
+  Optimizer::install(*jit, opt_level, object_cache.get(),
+                     dump_asm ? dump_assembly : Optimizer::Observer());
+  if (auto report = TimeReport::active())
+    report->install(*jit);
+  // the usual libm externs are found among the runtime's symbols, others in
+  // the process, once: each is defined in the runtime dylib the first time
+  // something links against it. before the bodies copy main's links.
+  ExitOnErr(link_runtime(*jit));
+  definitions = ExitOnErr(LazyDefinitions::create(*jit));
+  if (tiered)
+    tiers = ExitOnErr(Tiers::create(*jit, *definitions, tier_threshold));
+
+  // a compile thread can still be finishing the emission of a module whose
+  // symbols are already ready when its tracker is removed. its memory is freed
+  // then and there instead, which is all removing it was for.
+  jit->getExecutionSession().setErrorReporter([](Error err) {
+    handleAllErrors(
+        std::move(err), [](ResourceTrackerDefunct const &) {},
+        [](ErrorInfoBase const &e) {
+          errs() << "JIT session error: " << e.message() << '\n';
+        });
+  });
+  return jit;
+}
+
+// Release what create_jit made that refers into the jit, in the reverse of the
+// order it was made in. The profiler and object cache have to outlive the jit
+// instead, so they are kept.
+static void release_jit_state() {
+  tiers.reset();
+  definitions.reset();
+  contexts.reset();
+}
+
+// Add a module of definitions behind their stubs, returning what removes them
+// again. A function's old body has to be removed before it's redefined.
+//
+// With --tiered the functions are recompiled once they're hot. Bodies are
+// compiled on their first call, unless the caller starts compiling them
+// straight away.
+Expected<std::unique_ptr<ResourceTrackerManager>>
+add_definitions(ThreadSafeModule module) {
+  TimeReport::Timer timer(TimeReport::Add);
+  if (tiers) {
+    auto definition = tiers->add(std::move(module));
+    if (!definition)
+      return definition.takeError();
+    return std::make_unique<ResourceTrackerManager>(std::move(*definition));
+  }
+
+  auto bodies = definitions->get_bodies().createResourceTracker();
+  if (auto err = definitions->add(bodies, std::move(module)))
+    return std::move(err);
+  return std::make_unique<ResourceTrackerManager>(bodies);
+}
+
+// Where statements are parsed from. On a parse error, read() reports it to
+// errors as line:column with the statement's lines up to it and a caret under
+// the unexpected token, skips to where the next statement can start and throws.
+class StatementReader {
+public:
+  virtual ~StatementReader() = default;
+  virtual ast::Expr *read(Parser &p, ast::Arena &arena,
+                          std::ostream &errors) = 0;
 };
 
-class TeeString : public std::streambuf {
+// Reads from a stream a line at a time, keeping only what hasn't been parsed
+// yet. A statement that runs off the end of it is parsed again once the next
+// line has been read, so one that's complete at the end of a line ends there.
+class StreamReader : public StatementReader {
+  std::istream &input;
+  std::string pending;
+
+  bool read_line() {
+    std::string line;
+    if (!std::getline(input, line))
+      return false;
+    pending += line;
+    pending += '\n';
+    return true;
+  }
+
+  // drop what p has parsed, leaving the token it looked ahead at
+  void consume(Parser &p, Lexer const &lexer) {
+    pending.erase(0, p.peeking() ? p.peek_offset() : lexer.get_position());
+  }
+
 public:
-  std::istream *source;
-  std::string teed;
-  TeeString(std::istream *source) : source(source) {}
-
-  // supply some string to start at the end of.
-  TeeString(std::istream *source, std::string const &precursor)
-      : source(source), teed(precursor) {
-    setg(teed.data(), teed.data() + teed.size(), teed.data() + teed.size());
-  }
-  virtual int_type underflow() override {
-    auto c = source->get();
-    if (c == EOF)
-      return EOF;
-    teed.push_back(c);
-    setg(teed.data(), teed.data() + teed.size() - 1, teed.data() + teed.size());
-    return c;
-  }
-
-  // since ungetc isn't passed to the underlying stream, past the used size is
-  // where the ungotten characters are.
-  size_t used() const { return gptr() - eback(); }
+  StreamReader(std::istream &input) : input(input) {}
+
+  ast::Expr *read(Parser &p, ast::Arena &arena,
+                  std::ostream &errors) override {
+    for (;;) {
+      Lexer lexer(pending);
+      p.reset();
+      try {
+        if (auto ast = p.parse(lexer, arena)) {
+          consume(p, lexer);
+          return ast;
+        }
+      } catch (Parser::ParseError const &e) {
+        if (p.peek().type != Token::TypeEOF || !read_line()) {
+          p.diagnose(errors, e);
+          p.synchronize();
+          consume(p, lexer);
+          throw;
+        }
+        continue;
+      }
+
+      pending.clear();
+      if (!read_line())
+        return nullptr;
+    }
+  }
 };
 
-int run(std::istream &input, bool interactive = false) {
-  // todo: "taint" functions' removability if another function depends on it (or
-  // somehow regenerate dependent functions)
+// Lexes straight out of a buffer such as a mapped file. Statements are only
+// offsets into it, so nothing grows with the size of the input.
+//
+// After the first parse error the rest of the buffer is only checked, so every
+// error in it is reported in one pass; no more statements are returned.
+class BufferReader : public StatementReader {
+  Lexer lexer;
+
+public:
+  BufferReader(std::string_view source) : lexer(source) {}
+
+  ast::Expr *read(Parser &p, ast::Arena &arena,
+                  std::ostream &errors) override {
+    try {
+      return p.parse(lexer, arena);
+    } catch (Parser::ParseError const &e) {
+      p.diagnose(errors, e);
+    }
+
+    for (;;) {
+      p.synchronize();
+      // nothing checked outlives its statement
+      ast::Arena checked;
+      try {
+        if (!p.parse(lexer, checked))
+          break;
+      } catch (Parser::ParseError const &e) {
+        p.diagnose(errors, e);
+      }
+    }
+    throw Parser::ParseError{};
+  }
+};
+
+// where the first def or extern token at or after offset starts, or the end.
+// one that follows whitespace or a semicolon always starts a token, and there
+// are no comments or strings for one to hide in.
+static size_t next_definition(std::string_view source, size_t offset) {
+  for (; offset < source.size(); ++offset) {
+    if (offset && !isspace(static_cast<unsigned char>(source[offset - 1])) &&
+        source[offset - 1] != ';')
+      continue;
+    for (std::string_view keyword : {"def", "extern"}) {
+      auto end = offset + keyword.size();
+      if (source.substr(offset, keyword.size()) == keyword &&
+          (end == source.size() ||
+           !isalnum(static_cast<unsigned char>(source[end]))))
+        return offset;
+    }
+  }
+  return source.size();
+}
+
+// Parses a buffer on several threads. It's split into chunks at definitions and
+// externs, which always start a statement, and each chunk is parsed by a
+// Lexer and Parser of its own. A chunk's last statement is read from the whole
+// buffer like any other, and recovering from an error never skips past a def,
+// so read() hands out the same statements and parse errors in the same order
+// as a single BufferReader.
+//
+// The statements stay allocated in the reader until it's destroyed.
+class ParallelReader : public StatementReader {
+  struct Chunk {
+    std::unique_ptr<ast::Arena> arena;
+    // up to the first parse error
+    std::vector<ast::Expr *> statements;
+    // of every parse error in the chunk
+    std::string diagnostics;
+    bool failed = false;
+    size_t tokens = 0;
+  };
+
+  std::vector<std::future<Chunk>> pending;
+  // the ones read from so far, the last one being read
+  std::vector<Chunk> chunks;
+  size_t next_statement = 0;
+  bool reported = false;
+
+  // the statements that start in [start, end)
+  static Chunk parse(std::string_view source, size_t start, size_t end) {
+    Chunk chunk{std::make_unique<ast::Arena>()};
+    Lexer lexer(source, start);
+    Parser p;
+    std::ostringstream diagnostics;
+    do {
+      // after the first error, statements are only checked
+      ast::Arena checked;
+      try {
+        auto ast = p.parse(lexer, chunk.failed ? checked : *chunk.arena);
+        // after semicolons, the next chunk's
+        if (!ast || p.get_statement_offset() >= end)
+          break;
+        if (!chunk.failed)
+          chunk.statements.push_back(ast);
+      } catch (Parser::ParseError const &e) {
+        if (p.get_statement_offset() >= end)
+          break;
+        p.diagnose(diagnostics, e);
+        p.synchronize();
+        chunk.failed = true;
+      }
+    } while (p.peek_offset() < end);
+    chunk.diagnostics = diagnostics.str();
+    chunk.tokens = p.get_token_count();
+    return chunk;
+  }
+
+  void take_chunk() {
+    chunks.push_back(pending[chunks.size()].get());
+    next_statement = 0;
+    if (auto report = TimeReport::active()) {
+      report->count(TimeReport::Tokens, chunks.back().tokens);
+      report->count(TimeReport::Nodes, chunks.back().arena->size());
+    }
+  }
+
+public:
+  ParallelReader(std::string_view source, unsigned threads) {
+    size_t start = 0;
+    for (unsigned i = 1; i <= threads; ++i) {
+      auto end = i == threads
+                     ? source.size()
+                     : next_definition(source, source.size() / threads * i);
+      if (end <= start && i != threads)
+        continue;
+      pending.push_back(
+          std::async(std::launch::async, parse, source, start, end));
+      start = end;
+    }
+  }
+
+  ast::Expr *read(Parser &, ast::Arena &, std::ostream &errors) override {
+    if (reported)
+      return nullptr;
+    while (chunks.empty() ||
+           next_statement == chunks.back().statements.size()) {
+      if (!chunks.empty() && chunks.back().failed) {
+        // and those in the chunks after it
+        errors << chunks.back().diagnostics;
+        while (chunks.size() < pending.size()) {
+          take_chunk();
+          errors << chunks.back().diagnostics;
+        }
+        reported = true;
+        throw Parser::ParseError{};
+      }
+      if (chunks.size() == pending.size())
+        return nullptr;
+      take_chunk();
+    }
+    return chunks.back().statements[next_statement++];
+  }
+};
+
+// reader.read(), timed and counted for --time-report
+static ast::Expr *parse(StatementReader &reader, Parser &p, ast::Arena &arena,
+                        std::ostream &errors) {
+  auto report = TimeReport::active();
+  if (!report)
+    return reader.read(p, arena, errors);
+
+  auto tokens = p.get_token_count();
+  auto nodes = arena.size();
+  auto count = make_scope_exit([&] {
+    report->count(TimeReport::Tokens, p.get_token_count() - tokens);
+    report->count(TimeReport::Nodes, arena.size() - nodes);
+  });
+  TimeReport::Timer timer(TimeReport::Parse);
+  return reader.read(p, arena, errors);
+}
+
+// the next statement, simplified unless --simplify=false
+static ast::Expr *read(StatementReader &reader, Parser &p, ast::Arena &arena,
+                       std::ostream &errors) {
+  auto ast = parse(reader, p, arena, errors);
+  if (!ast || !simplify_ast)
+    return ast;
+  TimeReport::Timer timer(TimeReport::Simplify);
+  return ast->simplify(arena);
+}
+
+// ast.codegen(ctx), likewise
+static Value *codegen(ast::Expr &ast, CodegenContext &ctx) {
+  TimeReport::Timer timer(TimeReport::Codegen);
+  auto code = ast.codegen(ctx);
+  if (auto report = TimeReport::active())
+    if (auto f = dyn_cast<llvm::Function>(code))
+      report->count(TimeReport::Instructions, f->getInstructionCount());
+  return code;
+}
+
+// f(), timed as phase
+template <typename F> static auto timed(TimeReport::Phase phase, F &&f) {
+  TimeReport::Timer timer(phase);
+  return f();
+}
+
+int run(StatementReader &reader, bool interactive = false) {
   using namespace llvm;
   using namespace llvm::orc;
   InitializeNativeTarget();
@@ -63,9 +657,12 @@ int run(std::istream &input, bool interactive = false) {
   InitializeNativeTargetAsmPrinter();
   ExitOnError ExitOnErr;
 
-  auto jit = ExitOnErr(llvm::orc::LLJITBuilder().create());
-  std::map<std::string, std::shared_ptr<ast::Prototype>> prototypes;
-  std::map<std::string, std::unique_ptr<ResourceTrackerManager>> whatprovides;
+  auto jit = create_jit();
+  auto release = make_scope_exit(release_jit_state);
+  SignatureTable signatures;
+  DenseMap<Symbol, std::unique_ptr<ResourceTrackerManager>> whatprovides;
+  Callers callers;
+  auto stop_tiers = make_scope_exit([] { tiers.reset(); });
 
   Parser p;
   for (;;) {
@@ -74,40 +671,39 @@ int run(std::istream &input, bool interactive = false) {
       std::cerr << ">>> ";
 
     // read
-    CodegenContext ctx(jit.get(), &prototypes);
-    std::unique_ptr<ast::Expr> ast;
-
-    TeeString tee =
-        p.peeking() ? TeeString{&input, p.peek().literal} : TeeString{&input};
-    std::istream tee_stream(&tee);
+    // the statement's tree is released at the end of the iteration
+    ast::Arena arena;
+    ast::Expr *ast;
 
     try {
-      ast = p.parse(tee_stream);
-    } catch (Parser::ParseError e) {
-      std::cerr << e.what() << '\n';
-      std::string already_read = tee.teed;
-      std::string rest_of_line;
-      auto used = tee.used();
-      std::getline(tee_stream, rest_of_line);
-      std::cerr << already_read << rest_of_line << '\n';
-
-      for (auto i = int(used) - int(p.peek().literal.size()); i-- > 0;) {
-        if (tee.teed[i] == '\n')
-          break;
-        std::cerr << ' ';
-      }
-      std::cerr << "^ Unexpected " << p.next() << "\n";
+      ast = read(reader, p, arena, std::cerr);
+    } catch (Parser::ParseError const &) {
+      if (!interactive)
+        return 1;
+      continue;
+    }
+
+    if (!ast)
+      return 0;
+    dump_statement(*ast);
+
+    auto top = dyn_cast<ast::Function>(ast);
+    bool anonymous = top && top->get_name() == anon_expr;
+    auto prototype =
+        top ? &top->get_prototype() : dyn_cast<ast::Prototype>(ast);
+    if (prototype && !anonymous &&
+        !callers.allows(*prototype, signatures, std::cerr)) {
       if (!interactive)
         return 1;
       continue;
     }
 
     // compile
+    CodegenContext ctx(jit.get(), &signatures, contexts->get());
     Value *code;
     try {
-      code = ast->codegen(ctx);
-      code->print(llvm::errs());
-      llvm::errs() << "\n";
+      code = codegen(*ast, ctx);
+      dump_code(*code, interactive);
     } catch (CodegenException e) {
       std::cerr << e.what() << '\n';
       if (!interactive)
@@ -115,49 +711,535 @@ int run(std::istream &input, bool interactive = false) {
       continue;
     }
 
-    auto resource_tracker = jit->getMainJITDylib().createResourceTracker();
-
-    auto top = dynamic_cast<ast::Function *>(ast.get());
-    if (top) {
-      whatprovides[top->get_name()] =
-          std::make_unique<ResourceTrackerManager>(resource_tracker);
+    if (top && !anonymous) {
+      callers.define(top->get_name(), *ctx.module);
+      auto &provider = whatprovides[top->get_name()];
+      provider.reset();
+      provider = ExitOnErr(add_definitions(ctx.take_module()));
+      continue;
     }
 
-    auto ts_module =
-        ThreadSafeModule(std::move(ctx.module), std::move(ctx.ctx));
-    ExitOnErr(jit->addIRModule(resource_tracker, std::move(ts_module)));
+    auto resource_tracker = jit->getMainJITDylib().createResourceTracker();
+    ExitOnErr(timed(TimeReport::Add, [&] {
+      return jit->addIRModule(resource_tracker, ctx.take_module());
+    }));
 
     // evaluate if top level)
-    if (top && top->get_name() == "__anon_expr") {
-      auto expr_symbol = ExitOnErr(jit->lookup("__anon_expr"));
+    if (anonymous) {
+      auto expr_symbol = ExitOnErr(timed(
+          TimeReport::Lookup, [&] { return jit->lookup("__anon_expr"); }));
       // assert(ExprSymbol && "Function not found");
 
       // get function
       double (*FP)() = expr_symbol.toPtr<double (*)()>();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+      fprintf(stderr, "Evaluated to %f\n", timed(TimeReport::Execute, FP));
+      if (tiers)
+        tiers->release_cold();
+    }
 
-      // remove __anon_expr's module
-      whatprovides.erase(whatprovides.find("__anon_expr"));
+    // top level expressions and externs are done with
+    ExitOnErr(resource_tracker->remove());
+  }
+}
+
+// Codegen every statement of a script into ctx's module. Top level
+// expressions are given unique names, which are appended to anon_exprs in
+// source order. Returns false after reporting an error.
+bool compile_script(StatementReader &reader, CodegenContext &ctx,
+                    std::vector<std::string> &anon_exprs) {
+  Parser p;
+  for (;;) {
+    ast::Arena arena;
+    ast::Expr *ast;
+
+    try {
+      ast = read(reader, p, arena, std::cerr);
+    } catch (Parser::ParseError const &) {
+      return false;
+    }
+
+    if (!ast)
+      return true;
+    dump_statement(*ast);
+
+    if (auto top = dyn_cast<ast::Function>(ast)) {
+      auto name = top->get_name().str();
+      if (top->get_name() == anon_expr) {
+        anon_exprs.push_back(name.str() + "." +
+                             std::to_string(anon_exprs.size()));
+        top->set_name(Symbol::intern(anon_exprs.back()));
+      } else if (auto old = ctx.module->getFunction(name);
+                 old && !old->isDeclaration()) {
+        // redefinition: earlier callers keep the body they were compiled
+        // against
+        old->setName(name + ".prev");
+        ctx.functions.erase(top->get_name());
+        old->setLinkage(llvm::GlobalValue::InternalLinkage);
+      }
     }
 
-    // not top level so not managed by whatprovides
-    if (!top)
-      ExitOnErr(resource_tracker->remove());
+    try {
+      dump_code(*codegen(*ast, ctx), false);
+    } catch (CodegenException e) {
+      std::cerr << e.what() << '\n';
+      return false;
+    }
   }
 }
 
-int main(int argc, char *argv[]) {
-  if (argc < 2)
-    return run(std::cin, true);
+// Compile the whole script before running any of it. Every statement goes into
+// one module that is added to the jit once, and the top level expressions are
+// all looked up together and then evaluated in source order. With
+// --eval-threads they're evaluated concurrently instead, and their results
+// printed in source order once all are done.
+int run_batch(StatementReader &reader) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmParser();
+  InitializeNativeTargetAsmPrinter();
+  ExitOnError ExitOnErr;
+
+  auto jit = create_jit();
+  auto release = make_scope_exit(release_jit_state);
+  SignatureTable signatures;
+  std::vector<std::string> anon_exprs;
+
+  CodegenContext ctx(jit.get(), &signatures);
+  if (!compile_script(reader, ctx, anon_exprs))
+    return 1;
+
+  auto ts_module = ctx.take_module();
+  // nothing is redefined at run time, so calls only need to go through stubs
+  // to be compiled lazily
+  std::unique_ptr<ResourceTrackerManager> script;
+  if (lazy || tiered)
+    script = ExitOnErr(add_definitions(std::move(ts_module)));
+  else
+    ExitOnErr(timed(TimeReport::Add, [&] {
+      return jit->addIRModule(std::move(ts_module));
+    }));
+  auto stop_tiers = make_scope_exit([] { tiers.reset(); });
+
+  // materialize every top level expression in a single lookup
+  auto &es = jit->getExecutionSession();
+  SymbolLookupSet names;
+  for (auto &name : anon_exprs)
+    names.add(jit->mangleAndIntern(name));
+  auto symbols = ExitOnErr(timed(TimeReport::Lookup, [&] {
+    return es.lookup(makeJITDylibSearchOrder(&jit->getMainJITDylib()),
+                     std::move(names));
+  }));
+
+  std::vector<double (*)()> exprs;
+  for (auto &name : anon_exprs) {
+    auto &symbol = symbols[jit->mangleAndIntern(name)];
+    exprs.push_back(symbol.getAddress().toPtr<double (*)()>());
+  }
+
+  if (eval_threads <= 1) {
+    for (auto FP : exprs) {
+      fprintf(stderr, "Evaluated to %f\n", timed(TimeReport::Execute, FP));
+      if (tiers)
+        tiers->release_cold();
+    }
+    return 0;
+  }
+
+  // everything is already materialized, so the only calls into the jit from
+  // here on are lazy call-throughs and tier-ups, which ORC serializes itself
+  std::vector<double> results(exprs.size());
+  timed(TimeReport::Execute, [&] {
+    parallel_for(exprs.size(), eval_threads,
+                 [&](size_t i) { results[i] = exprs[i](); });
+  });
+  if (tiers)
+    tiers->release_cold();
+  for (auto result : results)
+    fprintf(stderr, "Evaluated to %f\n", result);
+  return 0;
+}
+
+// Lower the script to bytecode, or load it from --cache-dir, and interpret it.
+// Functions are handed to a jit, created the first time one is, after
+// --tier-threshold calls. Returns -1 without having run anything if the script
+// can't be lowered, or its externs linked, for it to be run another way.
+int run_interpreted(std::string_view source, StatementReader &reader) {
+  bytecode::Program program;
+  // what --dump-ast prints comes from parsing, so it isn't skipped
+  std::optional<bytecode::Program> cached;
+  if (!cache_dir.empty() && !dump_ast)
+    cached = bytecode::load_cached(cache_dir, source, simplify_ast);
+  if (cached) {
+    program = std::move(*cached);
+  } else {
+    bytecode::Writer writer(program);
+    Parser p;
+    try {
+      for (;;) {
+        ast::Arena arena;
+        ast::Expr *ast;
+        try {
+          ast = read(reader, p, arena, std::cerr);
+        } catch (Parser::ParseError const &) {
+          return 1;
+        }
+        if (!ast)
+          break;
+        dump_statement(*ast);
+        timed(TimeReport::Codegen, [&] { writer.add(*ast); });
+      }
+      writer.finish();
+    } catch (bytecode::Unsupported const &) {
+      return -1;
+    }
+    if (!cache_dir.empty())
+      bytecode::store_cached(cache_dir, source, simplify_ast, program);
+  }
+
+  std::unique_ptr<LLJIT> jit;
+  auto release = make_scope_exit(release_jit_state);
+  SignatureTable signatures;
+  auto compile = [&](ArrayRef<uint32_t> functions)
+      -> Expected<std::vector<void *>> {
+    if (!jit) {
+      InitializeNativeTarget();
+      InitializeNativeTargetAsmParser();
+      InitializeNativeTargetAsmPrinter();
+      jit = create_jit();
+    }
+    CodegenContext ctx(jit.get(), &signatures);
+    timed(TimeReport::Codegen,
+          [&] { bytecode::codegen(program, functions, ctx); });
+    for (auto f : functions)
+      dump_code(*ctx.module->getFunction(program.symbol(f)), false);
+    if (auto err = timed(TimeReport::Add, [&] {
+          return jit->addIRModule(ctx.take_module());
+        }))
+      return std::move(err);
+
+    std::vector<void *> addresses;
+    for (auto f : functions) {
+      auto symbol = timed(TimeReport::Lookup,
+                          [&] { return jit->lookup(program.symbol(f)); });
+      if (!symbol)
+        return symbol.takeError();
+      addresses.push_back(symbol->toPtr<void *>());
+    }
+    return addresses;
+  };
+
+  // an extern that can't be linked is left to batch mode to report
+  Interpreter interpreter(program, tier_threshold, compile);
+  if (auto err = interpreter.link()) {
+    consumeError(std::move(err));
+    return -1;
+  }
+  for (auto expression : program.expressions)
+    fprintf(stderr, "Evaluated to %f\n", timed(TimeReport::Execute, [&] {
+              return interpreter.run(expression);
+            }));
+  return 0;
+}
 
-  if (argc == 2) {
-    std::ifstream input(argv[1]);
-    if (input.fail()) {
-      std::cerr << "Failed to open " << argv[1] << ".";
+// Compile the script to an object file and/or shared library exporting its
+// functions under their own names. Top level expressions have nothing to run
+// them, so they are left out.
+int run_aot(StatementReader &reader) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmParser();
+  InitializeNativeTargetAsmPrinter();
+  ExitOnError ExitOnErr;
+
+  auto tm = ExitOnErr(create_host_target_machine(opt_level));
+  SignatureTable signatures;
+  std::vector<std::string> anon_exprs;
+
+  CodegenContext ctx(tm->createDataLayout(), &signatures);
+  if (!compile_script(reader, ctx, anon_exprs))
+    return 1;
+
+  for (auto &name : anon_exprs)
+    ctx.module->getFunction(name)->eraseFromParent();
+  ctx.optimize(opt_level);
+  dump_assembly(*ctx.module);
+
+  std::string object_path = emit_obj;
+  if (object_path.empty()) {
+    SmallString<128> temporary;
+    if (sys::fs::createTemporaryFile("kaleidoscope", "o", temporary)) {
+      std::cerr << "Failed to create a temporary object file.\n";
       return 1;
     }
-    return run(input, false);
+    object_path = std::string(temporary);
+  }
+
+  ExitOnErr(timed(TimeReport::Compile,
+                  [&] { return emit_object(*ctx.module, *tm, object_path); }));
+
+  if (!emit_shared.empty()) {
+    ExitOnErr(link_shared(object_path, emit_shared));
+    if (emit_obj.empty())
+      sys::fs::remove(object_path);
+  }
+  return 0;
+}
+
+// Parse, compile and evaluate a script as a pipeline. A thread parses ahead
+// while this one generates code and hands each module to the jit, which starts
+// compiling definitions on its compile threads straight away (or, with --lazy,
+// when they are first called). Top level expressions are evaluated in source
+// order on another thread as soon as they are ready.
+int run_pipelined(StatementReader &reader) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmParser();
+  InitializeNativeTargetAsmPrinter();
+  ExitOnError ExitOnErr;
+
+  auto jit = create_jit();
+  auto release = make_scope_exit(release_jit_state);
+  auto &es = jit->getExecutionSession();
+  SignatureTable signatures;
+  DenseMap<Symbol, std::unique_ptr<ResourceTrackerManager>> whatprovides;
+  Callers callers;
+  auto stop_tiers = make_scope_exit([] { tiers.reset(); });
+
+  // an empty ast ends the script, with diagnostics if it was a parse error
+  struct Parsed {
+    std::unique_ptr<ast::Arena> arena;
+    ast::Expr *ast;
+    std::string diagnostics;
+  };
+  Channel<Parsed> parsed(64);
+
+  std::thread parser([&] {
+    Parser p;
+    for (;;) {
+      auto arena = std::make_unique<ast::Arena>();
+      std::ostringstream diagnostics;
+      ast::Expr *ast = nullptr;
+      try {
+        ast = read(reader, p, *arena, diagnostics);
+      } catch (Parser::ParseError const &) {
+      }
+
+      if (!parsed.push({std::move(arena), ast, diagnostics.str()}) || !ast)
+        return;
+    }
+  });
+
+  struct Evaluation {
+    std::string name;
+    ResourceTrackerSP tracker;
+  };
+  Channel<Evaluation> evaluations;
+
+  std::thread evaluator([&] {
+    while (auto evaluation = evaluations.pop()) {
+      auto expr_symbol = ExitOnErr(timed(
+          TimeReport::Lookup, [&] { return jit->lookup(evaluation->name); }));
+      double (*FP)() = expr_symbol.toPtr<double (*)()>();
+      auto result = timed(TimeReport::Execute, FP);
+      {
+        auto lock = dumps.lock();
+        fprintf(stderr, "Evaluated to %f\n", result);
+      }
+      ExitOnErr(evaluation->tracker->remove());
+      // this is the only thread running jitted code
+      if (tiers)
+        tiers->release_cold();
+      evaluations.done();
+    }
+  });
+
+  // compiles started ahead of time have to finish before their trackers go
+  struct {
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t pending = 0;
+  } compiles;
+  auto join_compiles = [&] {
+    std::unique_lock<std::mutex> lock(compiles.mutex);
+    compiles.finished.wait(lock, [&] { return compiles.pending == 0; });
+  };
+
+  int status = 0;
+  size_t anon_exprs = 0;
+  while (auto statement = parsed.pop()) {
+    if (!statement->ast) {
+      // report in order with the results before it
+      evaluations.join();
+      std::cerr << statement->diagnostics;
+      status = statement->diagnostics.empty() ? 0 : 1;
+      break;
+    }
+    dump_statement(*statement->ast);
+
+    auto top = dyn_cast<ast::Function>(statement->ast);
+    bool anonymous = top && top->get_name() == anon_expr;
+    if (anonymous) {
+      // evaluations lag behind, so several can be in the jit at once
+      top->set_name(Symbol::intern(top->get_name().str().str() + "." +
+                                   std::to_string(anon_exprs++)));
+    }
+
+    auto prototype =
+        top ? &top->get_prototype() : dyn_cast<ast::Prototype>(statement->ast);
+    if (prototype && !anonymous &&
+        !callers.allows(*prototype, signatures, std::cerr)) {
+      evaluations.join();
+      status = 1;
+      break;
+    }
+
+    CodegenContext ctx(jit.get(), &signatures, contexts->get());
+    try {
+      dump_code(*codegen(*statement->ast, ctx), false);
+    } catch (CodegenException e) {
+      // pending evaluations may need the context to compile what they call
+      ctx.take_module();
+      evaluations.join();
+      std::cerr << e.what() << '\n';
+      status = 1;
+      break;
+    }
+
+    if (top && !anonymous)
+      callers.define(top->get_name(), *ctx.module);
+    auto ts_module = ctx.take_module();
+    if (top && !anonymous) {
+      auto &provider = whatprovides[top->get_name()];
+      // evaluations before this one should still see the old body, which may
+      // still be compiling
+      if (provider) {
+        evaluations.join();
+        join_compiles();
+        provider.reset();
+      }
+      provider = ExitOnErr(add_definitions(std::move(ts_module)));
+    } else {
+      auto resource_tracker = jit->getMainJITDylib().createResourceTracker();
+      ExitOnErr(timed(TimeReport::Add, [&] {
+        return jit->addIRModule(resource_tracker, std::move(ts_module));
+      }));
+      if (anonymous)
+        evaluations.push(
+            {std::string(top->get_name().str()), resource_tracker});
+      else
+        ExitOnErr(resource_tracker->remove());
+      continue;
+    }
+
+    if (!lazy && !tiered && compile_threads) {
+      // start compiling now rather than when something first calls it. any
+      // failure shows up again in the lookup that needs it. without compile
+      // threads this would compile right here, racing the evaluator on the
+      // jit's one target machine.
+      {
+        std::lock_guard<std::mutex> lock(compiles.mutex);
+        ++compiles.pending;
+      }
+      es.lookup(
+          LookupKind::Static,
+          makeJITDylibSearchOrder(&definitions->get_bodies()),
+          SymbolLookupSet(jit->mangleAndIntern(top->get_name().str())),
+          SymbolState::Ready,
+          [&compiles](Expected<SymbolMap> result) {
+            consumeError(result.takeError());
+            std::lock_guard<std::mutex> lock(compiles.mutex);
+            --compiles.pending;
+            compiles.finished.notify_all();
+          },
+          NoDependenciesToRegister);
+    }
+  }
+
+  parsed.close();
+  evaluations.close();
+  parser.join();
+  evaluator.join();
+  join_compiles();
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope REPL\n");
+
+  if (opt_level > 3) {
+    std::cerr << "Invalid optimization level -O" << opt_level << ".\n";
+    return 1;
+  }
+
+  if (tier_threshold == 0) {
+    std::cerr << "Invalid tier threshold 0.\n";
+    return 1;
+  }
+
+  if (!dumps.open(dump_file))
+    return 1;
+
+  // once whatever ran has finished with the jit
+  if (time_report || time_report_json || profile)
+    TimeReport::enable();
+  auto print_report = make_scope_exit([] {
+    if (profiler)
+      profiler->stop();
+    if (auto report = TimeReport::active())
+      dumps.write([&](raw_ostream &out) {
+        if (profiler)
+          profiler->report(*report);
+        if (time_report_json)
+          report->print_json(out);
+        else
+          report->print(out);
+      });
+  });
+
+  bool aot = !emit_obj.empty() || !emit_shared.empty();
+  if (script_path.empty() && aot) {
+    std::cerr << "Ahead of time compilation needs a script.\n";
+    return 1;
   }
 
-  std::cerr << "Usage: " << argv[0] << " [SCRIPT]";
+  if (script_path.empty()) {
+    StreamReader reader(std::cin);
+    return run(reader, true);
+  }
+
+  // large files are mapped rather than read
+  auto file = MemoryBuffer::getFile(script_path, /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+  if (!file) {
+    std::cerr << "Failed to open " << script_path << ".";
+    return 1;
+  }
+  auto contents = (*file)->getBuffer();
+  std::string_view source(contents.data(), contents.size());
+
+  // the parser lexes as it goes, so lexing is timed on its own, up front
+  if (TimeReport::active()) {
+    TimeReport::Timer timer(TimeReport::Lex);
+    Lexer lexer(source);
+    while (lexer.next().type != Token::TypeEOF)
+      ;
+  }
+
+  auto make_reader = [&]() -> std::unique_ptr<StatementReader> {
+    if (parse_threads > 1)
+      return std::make_unique<ParallelReader>(source, parse_threads);
+    return std::make_unique<BufferReader>(source);
+  };
+  auto reader = make_reader();
+
+  if (aot)
+    return run_aot(*reader);
+  if (interpret) {
+    auto status = run_interpreted(source, *reader);
+    if (status >= 0)
+      return status;
+    // compiled as a whole instead, from the start
+    reader = make_reader();
+    return run_batch(*reader);
+  }
+  if (batch)
+    return run_batch(*reader);
+  return run_pipelined(*reader);
 }
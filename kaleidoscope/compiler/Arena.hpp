@@ -0,0 +1,59 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Allocator.h"
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+namespace ast {
+
+// Bump allocator owning one statement's syntax tree. Everything allocated from
+// it is released at once when the arena is destroyed. Destructors are only run
+// for the types that have non-trivial ones.
+class Arena {
+  struct Cleanup {
+    void (*destroy)(void *);
+    void *object;
+    Cleanup *next;
+  };
+
+  llvm::BumpPtrAllocator allocator;
+  Cleanup *cleanups = nullptr;
+  size_t made = 0;
+
+public:
+  Arena() = default;
+  Arena(Arena const &) = delete;
+  Arena &operator=(Arena const &) = delete;
+
+  ~Arena() {
+    for (auto c = cleanups; c; c = c->next)
+      c->destroy(c->object);
+  }
+
+  template <typename T, typename... Args> T *make(Args &&...args) {
+    ++made;
+    auto object = new (allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      cleanups = new (allocator.Allocate<Cleanup>()) Cleanup{
+          [](void *p) { static_cast<T *>(p)->~T(); }, object, cleanups};
+    }
+    return object;
+  }
+
+  // how many objects have been made
+  size_t size() const { return made; }
+
+  template <typename T> llvm::ArrayRef<T> copy(llvm::ArrayRef<T> values) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto storage = allocator.Allocate<T>(values.size());
+    std::copy(values.begin(), values.end(), storage);
+    return {storage, values.size()};
+  }
+};
+
+} // namespace ast
+
+#endif
@@ -0,0 +1,122 @@
+#include "Bytecode.hpp"
+#include "Parser.hpp"
+
+// The syntax trees' emit() methods, lowering them to bytecode the way their
+// codegen() generates IR, so the interpreter computes the same doubles.
+
+namespace ast {
+
+using bytecode::Op;
+
+void NumberExpr::emit(bytecode::Writer &out) const { out.constant(value); }
+
+void VariableExpr::emit(bytecode::Writer &out) const {
+  out.emit(Op::Load, out.lookup(name, false));
+}
+
+void BinaryExpr::emit(bytecode::Writer &out) const {
+  lhs->emit(out);
+  rhs->emit(out);
+  switch (op) {
+  case BinaryOp::Less:
+    out.emit(Op::Less);
+    return;
+  case BinaryOp::Add:
+    out.emit(Op::Add);
+    return;
+  case BinaryOp::Subtract:
+    out.emit(Op::Subtract);
+    return;
+  case BinaryOp::Multiply:
+    out.emit(Op::Multiply);
+    return;
+  }
+  llvm_unreachable("unknown binary operator");
+}
+
+// without arrays, len(x) is a call like any other
+void CallExpr::emit(bytecode::Writer &out) const {
+  for (auto argument : arguments)
+    argument->emit(out);
+  out.call(callee, arguments.size());
+}
+
+void IndexExpr::emit(bytecode::Writer &) const {
+  throw bytecode::Unsupported{};
+}
+
+void StoreExpr::emit(bytecode::Writer &) const {
+  throw bytecode::Unsupported{};
+}
+
+void AssignExpr::emit(bytecode::Writer &out) const {
+  value->emit(out);
+  out.emit(Op::Store, out.lookup(variable, true));
+}
+
+void Prototype::emit(bytecode::Writer &) const {
+  throw bytecode::Unsupported{};
+}
+
+void Function::emit(bytecode::Writer &out) const {
+  body->emit(out);
+  out.emit(Op::Return);
+}
+
+void If::emit(bytecode::Writer &out) const {
+  condition->emit(out);
+  auto to_else = out.emit(Op::JumpIfZero);
+  then_expr->emit(out);
+  auto to_end = out.emit(Op::Jump);
+  out.patch(to_else);
+  else_expr->emit(out);
+  out.patch(to_end);
+}
+
+// the body runs, then the step and end are evaluated with the variable as it
+// was, and if the end isn't 0 the variable is stepped and the body runs again.
+// the loop's value is 0.
+void For::emit(bytecode::Writer &out) const {
+  start->emit(out);
+  auto variable = out.bind(loop_var_name, false);
+  out.emit(Op::Store, variable);
+  out.emit(Op::Pop);
+
+  auto loop = out.position();
+  body->emit(out);
+  out.emit(Op::Pop);
+  out.emit(Op::Load, variable);
+  if (step)
+    step->emit(out);
+  else
+    out.constant(1.0);
+  out.emit(Op::Add);
+  end->emit(out);
+  auto to_end = out.emit(Op::JumpIfZero);
+  out.emit(Op::Store, variable);
+  out.emit(Op::Pop);
+  out.emit(Op::Jump, loop);
+
+  // the next value, unused
+  out.patch(to_end);
+  out.emit(Op::Pop);
+  out.unbind();
+  out.constant(0.0);
+}
+
+void Var::emit(bytecode::Writer &out) const {
+  for (auto &binding : bindings) {
+    // before the variable is bound, so var x = x reads the outer x
+    if (binding.initializer)
+      binding.initializer->emit(out);
+    else
+      out.constant(0.0);
+    out.emit(Op::Store, out.bind(binding.name, true));
+    out.emit(Op::Pop);
+  }
+  body->emit(out);
+  for (size_t i = 0; i < bindings.size(); ++i)
+    out.unbind();
+}
+
+} // namespace ast
@@ -0,0 +1,135 @@
+#include "Parser.hpp"
+#include <charconv>
+#include <cmath>
+
+// The syntax trees' print() methods, for --dump-ast.
+
+namespace ast {
+
+// what the parser names top level expressions
+static Symbol const anon_expr = Symbol::intern("__anon_expr");
+
+// the shortest digits that read back as value. the lexer has no exponents,
+// and no minus sign, so folded negatives are printed as a subtraction from 0
+// (which loses the sign of -0).
+void NumberExpr::print(llvm::raw_ostream &out) const {
+  char digits[400];
+  auto [end, ec] = std::to_chars(digits, std::end(digits), std::fabs(value),
+                                 std::chars_format::fixed);
+  if (std::signbit(value))
+    out << "(0 - " << llvm::StringRef(digits, end - digits) << ')';
+  else
+    out << llvm::StringRef(digits, end - digits);
+}
+
+void VariableExpr::print(llvm::raw_ostream &out) const { out << name.str(); }
+
+void BinaryExpr::print(llvm::raw_ostream &out) const {
+  out << '(';
+  lhs->print(out);
+  out << ' ' << info(op).spelling << ' ';
+  rhs->print(out);
+  out << ')';
+}
+
+void CallExpr::print(llvm::raw_ostream &out) const {
+  out << callee.str() << '(';
+  for (size_t i = 0; i < arguments.size(); ++i) {
+    if (i)
+      out << ", ";
+    arguments[i]->print(out);
+  }
+  out << ')';
+}
+
+void IndexExpr::print(llvm::raw_ostream &out) const {
+  out << array.str() << '[';
+  index->print(out);
+  out << ']';
+}
+
+void StoreExpr::print(llvm::raw_ostream &out) const {
+  out << '(' << array.str() << '[';
+  index->print(out);
+  out << "] = ";
+  value->print(out);
+  out << ')';
+}
+
+void AssignExpr::print(llvm::raw_ostream &out) const {
+  out << '(' << variable.str() << " = ";
+  value->print(out);
+  out << ')';
+}
+
+// name(x ys[])
+static void print_signature(llvm::raw_ostream &out,
+                            Prototype const &prototype) {
+  out << prototype.get_name().str() << '(';
+  auto arguments = prototype.get_arguments();
+  auto signature = prototype.get_signature();
+  for (unsigned i = 0; i < arguments.size(); ++i) {
+    if (i)
+      out << ' ';
+    out << arguments[i].str();
+    if (signature.is_array(i))
+      out << "[]";
+  }
+  out << ')';
+}
+
+void Prototype::print(llvm::raw_ostream &out) const {
+  out << "extern ";
+  print_signature(out, *this);
+}
+
+void Function::print(llvm::raw_ostream &out) const {
+  if (get_name() != anon_expr) {
+    out << "def ";
+    print_signature(out, *prototype);
+    out << ' ';
+  }
+  body->print(out);
+}
+
+void If::print(llvm::raw_ostream &out) const {
+  out << "(if ";
+  condition->print(out);
+  out << " then ";
+  then_expr->print(out);
+  out << " else ";
+  else_expr->print(out);
+  out << ')';
+}
+
+void For::print(llvm::raw_ostream &out) const {
+  out << "(for " << loop_var_name.str() << " = ";
+  start->print(out);
+  out << ", ";
+  end->print(out);
+  if (step) {
+    out << ", ";
+    step->print(out);
+  }
+  out << " in ";
+  body->print(out);
+  out << ')';
+}
+
+void Var::print(llvm::raw_ostream &out) const {
+  out << "(var ";
+  for (size_t i = 0; i < bindings.size(); ++i) {
+    if (i)
+      out << ", ";
+    out << bindings[i].name.str();
+    if (bindings[i].initializer) {
+      out << " = ";
+      bindings[i].initializer->print(out);
+    }
+  }
+  out << " in ";
+  body->print(out);
+  out << ')';
+}
+
+} // namespace ast
@@ -0,0 +1,116 @@
+#include "Parser.hpp"
+#include <algorithm>
+#include <cmath>
+
+// The syntax trees' simplify() methods, run between parsing and codegen so
+// constant subexpressions never reach the IR builder.
+//
+// Every rewrite gives the same double as the code it replaces would, NaNs and
+// signed zeros included. x + 0 is left alone since -0 + 0 is +0, and x * 0
+// since x may be infinite or negative.
+
+namespace ast {
+
+// the value of e, if it's a number
+static std::optional<double> constant(Expr const *e) {
+  if (auto number = llvm::dyn_cast<NumberExpr>(e))
+    return number->get_value();
+  return std::nullopt;
+}
+
+Expr *NumberExpr::simplify(Arena &) { return this; }
+
+Expr *VariableExpr::simplify(Arena &) { return this; }
+
+Expr *BinaryExpr::simplify(Arena &arena) {
+  lhs = lhs->simplify(arena);
+  rhs = rhs->simplify(arena);
+  auto l = constant(lhs), r = constant(rhs);
+
+  if (l && r) {
+    switch (op) {
+    case BinaryOp::Less:
+      // fcmp ult, which is true when either is NaN
+      return arena.make<NumberExpr>(!(*l >= *r) ? 1.0 : 0.0);
+    case BinaryOp::Add:
+      return arena.make<NumberExpr>(*l + *r);
+    case BinaryOp::Subtract:
+      return arena.make<NumberExpr>(*l - *r);
+    case BinaryOp::Multiply:
+      return arena.make<NumberExpr>(*l * *r);
+    }
+  }
+
+  // x * 1, 1 * x and x - 0
+  if (op == BinaryOp::Multiply && r == 1.0)
+    return lhs;
+  if (op == BinaryOp::Multiply && l == 1.0)
+    return rhs;
+  if (op == BinaryOp::Subtract && r == 0.0 && !std::signbit(*r))
+    return lhs;
+  return this;
+}
+
+Expr *CallExpr::simplify(Arena &arena) {
+  llvm::SmallVector<Expr *, 4> simplified;
+  for (auto argument : arguments)
+    simplified.push_back(argument->simplify(arena));
+  if (!std::equal(simplified.begin(), simplified.end(), arguments.begin()))
+    arguments = arena.copy(llvm::ArrayRef<Expr *>(simplified));
+  return this;
+}
+
+Expr *IndexExpr::simplify(Arena &arena) {
+  index = index->simplify(arena);
+  return this;
+}
+
+Expr *StoreExpr::simplify(Arena &arena) {
+  index = index->simplify(arena);
+  value = value->simplify(arena);
+  return this;
+}
+
+Expr *AssignExpr::simplify(Arena &arena) {
+  value = value->simplify(arena);
+  return this;
+}
+
+Expr *Prototype::simplify(Arena &) { return this; }
+
+Expr *Function::simplify(Arena &arena) {
+  body = body->simplify(arena);
+  return this;
+}
+
+Expr *If::simplify(Arena &arena) {
+  condition = condition->simplify(arena);
+  // fcmp one against 0, which is false for NaN
+  if (auto c = constant(condition))
+    return (*c < 0 || *c > 0 ? then_expr : else_expr)->simplify(arena);
+
+  then_expr = then_expr->simplify(arena);
+  else_expr = else_expr->simplify(arena);
+  return this;
+}
+
+Expr *For::simplify(Arena &arena) {
+  start = start->simplify(arena);
+  end = end->simplify(arena);
+  if (step)
+    step = step->simplify(arena);
+  body = body->simplify(arena);
+  return this;
+}
+
+Expr *Var::simplify(Arena &arena) {
+  llvm::SmallVector<Binding, 4> simplified(bindings.begin(), bindings.end());
+  for (auto &binding : simplified)
+    if (binding.initializer)
+      binding.initializer = binding.initializer->simplify(arena);
+  bindings = arena.copy(llvm::ArrayRef<Binding>(simplified));
+  body = body->simplify(arena);
+  return this;
+}
+
+} // namespace ast
@@ -0,0 +1,476 @@
+#include "Bytecode.hpp"
+#include "Parser.hpp"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include <algorithm>
+#include <cstring>
+
+namespace bytecode {
+
+// what the parser names top level expressions
+static Symbol const anon_expr = Symbol::intern("__anon_expr");
+
+// bumped whenever the encoding or the meaning of an instruction changes
+static constexpr char magic[4] = {'K', 'S', 'B', 'C'};
+static constexpr uint32_t version = 1;
+
+char const *Unsupported::what() const noexcept {
+  return "unsupported in bytecode";
+}
+
+std::string Program::symbol(uint32_t function) const {
+  auto &f = functions[function];
+  if (f.is_extern())
+    return f.name;
+  for (uint32_t i = 0; i < functions.size(); ++i)
+    if (i != function && !functions[i].is_extern() &&
+        functions[i].name == f.name)
+      return f.name + "." + std::to_string(function);
+  return f.name;
+}
+
+std::vector<uint32_t> Program::reachable(uint32_t function) const {
+  std::vector<uint32_t> found = {function};
+  std::vector<bool> seen(functions.size());
+  seen[function] = true;
+  for (size_t i = 0; i < found.size(); ++i)
+    for (auto &instruction : functions[found[i]].code)
+      if ((instruction.op == Op::Call || instruction.op == Op::TailCall) &&
+          !seen[instruction.operand]) {
+        seen[instruction.operand] = true;
+        found.push_back(instruction.operand);
+      }
+  return found;
+}
+
+Writer::Writer(Program &program) : program(program), function(0) {}
+
+void Writer::add(ast::Expr &statement) {
+  auto definition = llvm::dyn_cast<ast::Function>(&statement);
+  auto prototype = definition ? &definition->get_prototype()
+                              : llvm::dyn_cast<ast::Prototype>(&statement);
+  if (!prototype || prototype->get_signature().arrays ||
+      prototype->get_signature().arity > Function::max_slots)
+    throw Unsupported{};
+
+  auto name = prototype->get_name();
+  uint32_t index = program.functions.size();
+  auto &added = program.functions.emplace_back();
+  added.name = name.str().str();
+  added.arity = prototype->get_signature().arity;
+  if (!definition) {
+    added.slots = added.arity;
+    externs[name] = index;
+    return;
+  }
+
+  // the body's calls to name are to this definition
+  if (name == anon_expr) {
+    program.expressions.push_back(index);
+  } else {
+    definitions[name] = index;
+    auto waiting = forward.find(name);
+    if (waiting != forward.end()) {
+      for (auto call : waiting->second)
+        resolve(call, index);
+      forward.erase(waiting);
+    }
+  }
+
+  function = index;
+  scope.clear();
+  for (auto argument : prototype->get_arguments())
+    bind(argument, false);
+  definition->emit(*this);
+
+  // a jump to a return returns itself, and a call followed by a return is a
+  // tail call, so tail recursion runs in constant space as it does jitted
+  auto &code = current().code;
+  for (auto &instruction : code)
+    if (instruction.op == Op::Jump &&
+        code[instruction.operand].op == Op::Return)
+      instruction = {Op::Return, 0};
+  for (size_t i = 0; i + 1 < code.size(); ++i)
+    if (code[i].op == Op::Call && code[i + 1].op == Op::Return)
+      code[i].op = Op::TailCall;
+}
+
+void Writer::finish() {
+  for (auto &[name, calls] : forward) {
+    auto e = externs.find(name);
+    if (e == externs.end())
+      throw Unsupported{};
+    for (auto call : calls)
+      resolve(call, e->second);
+  }
+  forward.clear();
+}
+
+void Writer::resolve(Call call, uint32_t callee) {
+  if (program.functions[callee].arity != call.arguments)
+    throw Unsupported{};
+  program.functions[call.function].code[call.at].operand = callee;
+}
+
+size_t Writer::emit(Op op, uint32_t operand) {
+  auto &code = current().code;
+  code.push_back({op, operand});
+  return code.size() - 1;
+}
+
+size_t Writer::position() const {
+  return program.functions[function].code.size();
+}
+
+void Writer::patch(size_t at) { current().code[at].operand = position(); }
+
+void Writer::constant(double value) {
+  // compared bitwise, so 0 and -0 stay apart
+  auto &constants = current().constants;
+  auto found = std::find_if(constants.begin(), constants.end(), [&](double c) {
+    return std::memcmp(&c, &value, sizeof value) == 0;
+  });
+  if (found == constants.end()) {
+    constants.push_back(value);
+    found = constants.end() - 1;
+  }
+  emit(Op::Constant, found - constants.begin());
+}
+
+unsigned Writer::bind(Symbol name, bool assignable) {
+  if (current().slots == Function::max_slots)
+    throw Unsupported{};
+  auto slot = current().slots++;
+  scope.push_back({name, slot, assignable});
+  return slot;
+}
+
+void Writer::unbind() { scope.pop_back(); }
+
+unsigned Writer::lookup(Symbol name, bool to_assign) const {
+  for (auto i = scope.rbegin(); i != scope.rend(); ++i)
+    if (i->name == name) {
+      if (to_assign && !i->assignable)
+        throw Unsupported{};
+      return i->slot;
+    }
+  throw Unsupported{};
+}
+
+void Writer::call(Symbol callee, size_t arguments) {
+  Call call{function, uint32_t(emit(Op::Call)), arguments};
+  auto found = definitions.find(callee);
+  if (found != definitions.end())
+    resolve(call, found->second);
+  else
+    forward[callee].push_back(call);
+}
+
+static llvm::Error malformed(Function const &f, char const *why) {
+  return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                 "Malformed bytecode in %s: %s",
+                                 f.name.c_str(), why);
+}
+
+// the stack depths before each instruction, or an error if they're
+// inconsistent. operands have been checked already.
+static llvm::Expected<std::vector<unsigned>>
+depths(Program const &program, Function const &f, unsigned &max) {
+  std::vector<unsigned> depth(f.code.size(), unreachable);
+  std::vector<size_t> pending = {0};
+  depth[0] = 0;
+  max = 0;
+  // reach to with the stack d deep
+  auto reach = [&](size_t to, unsigned d) -> bool {
+    if (to >= f.code.size())
+      return false;
+    if (depth[to] == unreachable) {
+      depth[to] = d;
+      pending.push_back(to);
+    }
+    return depth[to] == d;
+  };
+
+  while (!pending.empty()) {
+    auto pc = pending.back();
+    pending.pop_back();
+    auto [op, operand] = f.code[pc];
+    auto d = depth[pc];
+    // how many values the instruction takes, and how many it leaves
+    unsigned takes = 0, leaves = 0;
+    switch (op) {
+    case Op::Constant:
+    case Op::Load:
+      leaves = 1;
+      break;
+    case Op::Store:
+      takes = leaves = 1;
+      break;
+    case Op::Pop:
+    case Op::JumpIfZero:
+      takes = 1;
+      break;
+    case Op::Add:
+    case Op::Subtract:
+    case Op::Multiply:
+    case Op::Less:
+      takes = 2;
+      leaves = 1;
+      break;
+    case Op::Jump:
+      break;
+    case Op::Call:
+    case Op::TailCall:
+      takes = program.functions[operand].arity;
+      leaves = 1;
+      break;
+    case Op::Return:
+      takes = 1;
+      break;
+    }
+    if (d < takes)
+      return malformed(f, "stack underflow");
+    d = d - takes + leaves;
+    max = std::max(max, d);
+
+    // nothing but what's returned
+    if (op == Op::Return || op == Op::TailCall) {
+      if (d != (op == Op::Return ? 0 : 1))
+        return malformed(f, "values left on the stack at a return");
+      continue;
+    }
+    bool consistent = true;
+    if (op == Op::Jump || op == Op::JumpIfZero)
+      consistent = reach(operand, d);
+    if (op != Op::Jump)
+      consistent = consistent && reach(pc + 1, d);
+    if (!consistent)
+      return malformed(f, "stack depths disagree, or code runs off the end");
+  }
+  return depth;
+}
+
+llvm::Error verify(Program const &program) {
+  for (auto &f : program.functions) {
+    if (f.slots < f.arity)
+      return malformed(f, "fewer slots than arguments");
+    if (f.slots > Function::max_slots)
+      return malformed(f, "too many slots");
+    for (auto [op, operand] : f.code) {
+      bool in_range = true;
+      switch (op) {
+      case Op::Constant:
+        in_range = operand < f.constants.size();
+        break;
+      case Op::Load:
+      case Op::Store:
+        in_range = operand < f.slots;
+        break;
+      case Op::Jump:
+      case Op::JumpIfZero:
+        in_range = operand < f.code.size();
+        break;
+      case Op::Call:
+      case Op::TailCall:
+        in_range = operand < program.functions.size();
+        break;
+      case Op::Pop:
+      case Op::Add:
+      case Op::Subtract:
+      case Op::Multiply:
+      case Op::Less:
+      case Op::Return:
+        break;
+      default:
+        return malformed(f, "unknown instruction");
+      }
+      if (!in_range)
+        return malformed(f, "operand out of range");
+    }
+    unsigned max;
+    if (!f.is_extern())
+      if (auto d = depths(program, f, max); !d)
+        return d.takeError();
+  }
+
+  for (auto e : program.expressions)
+    if (e >= program.functions.size() || program.functions[e].is_extern() ||
+        program.functions[e].arity)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "Malformed bytecode: top level "
+                                     "expression %u isn't one",
+                                     e);
+  return llvm::Error::success();
+}
+
+std::vector<unsigned> stack_depths(Program const &program, uint32_t function,
+                                   unsigned &max) {
+  return llvm::cantFail(depths(program, program.functions[function], max));
+}
+
+void write(Program const &program, llvm::raw_ostream &out) {
+  llvm::support::endian::Writer writer(out, llvm::support::little);
+  out.write(magic, sizeof magic);
+  writer.write<uint32_t>(version);
+
+  writer.write<uint32_t>(program.functions.size());
+  for (auto &f : program.functions) {
+    writer.write<uint32_t>(f.name.size());
+    out << f.name;
+    writer.write<uint32_t>(f.arity);
+    writer.write<uint32_t>(f.slots);
+    writer.write<uint32_t>(f.constants.size());
+    for (auto c : f.constants)
+      writer.write<uint64_t>(llvm::bit_cast<uint64_t>(c));
+    writer.write<uint32_t>(f.code.size());
+    for (auto [op, operand] : f.code) {
+      writer.write<uint8_t>(uint8_t(op));
+      writer.write<uint32_t>(operand);
+    }
+  }
+
+  writer.write<uint32_t>(program.expressions.size());
+  for (auto e : program.expressions)
+    writer.write<uint32_t>(e);
+}
+
+// reads the encoding from the front of data, which stays empty once it runs
+// out
+class Reader {
+  llvm::StringRef data;
+  bool truncated = false;
+
+public:
+  explicit Reader(llvm::StringRef data) : data(data) {}
+
+  bool failed() const { return truncated; }
+
+  template <typename T> T take() {
+    if (data.size() < sizeof(T)) {
+      truncated = true;
+      data = {};
+      return T();
+    }
+    auto value = llvm::support::endian::read<T, llvm::support::little>(
+        data.data());
+    data = data.drop_front(sizeof(T));
+    return value;
+  }
+
+  llvm::StringRef take(size_t size) {
+    if (data.size() < size) {
+      truncated = true;
+      data = {};
+      return {};
+    }
+    auto taken = data.take_front(size);
+    data = data.drop_front(size);
+    return taken;
+  }
+
+  // a count of items at least size bytes each, if that many could be left
+  uint32_t count(size_t size) {
+    auto n = take<uint32_t>();
+    if (n > data.size() / size) {
+      truncated = true;
+      data = {};
+      return 0;
+    }
+    return n;
+  }
+};
+
+llvm::Expected<Program> read(llvm::StringRef data) {
+  Reader reader(data);
+  if (reader.take(sizeof magic) != llvm::StringRef(magic, sizeof magic) ||
+      reader.take<uint32_t>() != version)
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "Not bytecode of version %u", version);
+
+  Program program;
+  program.functions.resize(reader.count(5 * sizeof(uint32_t)));
+  for (auto &f : program.functions) {
+    f.name = reader.take(reader.count(1)).str();
+    f.arity = reader.take<uint32_t>();
+    f.slots = reader.take<uint32_t>();
+    f.constants.resize(reader.count(sizeof(uint64_t)));
+    for (auto &c : f.constants)
+      c = llvm::bit_cast<double>(reader.take<uint64_t>());
+    f.code.resize(reader.count(5));
+    for (auto &instruction : f.code) {
+      instruction.op = Op(reader.take<uint8_t>());
+      instruction.operand = reader.take<uint32_t>();
+    }
+  }
+  program.expressions.resize(reader.count(sizeof(uint32_t)));
+  for (auto &e : program.expressions)
+    e = reader.take<uint32_t>();
+
+  if (reader.failed())
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "Truncated bytecode");
+  if (auto err = verify(program))
+    return std::move(err);
+  return program;
+}
+
+static std::string cache_path(llvm::StringRef directory,
+                              llvm::StringRef source, bool simplified) {
+  llvm::SHA256 hash;
+  hash.update(llvm::StringRef(magic, sizeof magic));
+  hash.update(std::to_string(version));
+  hash.update(simplified ? "simplified\n" : "as parsed\n");
+  hash.update(source);
+  llvm::SmallString<128> path(directory);
+  llvm::sys::path::append(path, llvm::toHex(hash.final(), true) + ".kbc");
+  return std::string(path);
+}
+
+std::optional<Program> load_cached(llvm::StringRef directory,
+                                   llvm::StringRef source, bool simplified) {
+  auto file =
+      llvm::MemoryBuffer::getFile(cache_path(directory, source, simplified));
+  if (!file)
+    return std::nullopt;
+  auto program = read((*file)->getBuffer());
+  if (!program) {
+    llvm::consumeError(program.takeError());
+    return std::nullopt;
+  }
+  return std::move(*program);
+}
+
+void store_cached(llvm::StringRef directory, llvm::StringRef source,
+                  bool simplified, Program const &program) {
+  if (llvm::sys::fs::create_directories(directory))
+    return;
+
+  auto final_path = cache_path(directory, source, simplified);
+  int fd;
+  llvm::SmallString<128> temporary;
+  if (llvm::sys::fs::createUniqueFile(final_path + ".%%%%%%.tmp", fd,
+                                      temporary))
+    return;
+
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    write(program, out);
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(temporary);
+      return;
+    }
+  }
+
+  // rename is atomic, so concurrent readers see either nothing or the whole
+  // program
+  if (llvm::sys::fs::rename(temporary, final_path))
+    llvm::sys::fs::remove(temporary);
+}
+
+} // namespace bytecode
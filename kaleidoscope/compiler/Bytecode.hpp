@@ -0,0 +1,178 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include "Symbol.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct CodegenContext;
+namespace ast {
+class Expr;
+}
+
+// A script lowered from its syntax trees to code for a stack machine over
+// doubles, which is compact enough to cache on disk and simple enough to run
+// without parsing or LLVM.
+//
+// A function's arguments, and the variables for and var bind, live in
+// numbered slots of its frame. Instructions push, pop and combine values on
+// the frame's stack, and a function returns the value on top of it.
+//
+// Calls name their callee by its index in the program, bound the way batch
+// mode binds them: to the latest definition so far, or if there's none yet, to
+// the next one after the call, or failing that to an extern.
+//
+// Arrays aren't supported. Lowering a statement that uses them, or that
+// codegen would reject, throws Unsupported.
+namespace bytecode {
+
+enum class Op : uint8_t {
+  // push constants[operand]
+  Constant,
+  // push slots[operand]
+  Load,
+  // slots[operand] = the top of the stack, which stays there
+  Store,
+  Pop,
+  // pop two and push the result, as BinaryExpr's codegen computes it
+  Add,
+  Subtract,
+  Multiply,
+  Less,
+  // go to operand
+  Jump,
+  // pop, and go to operand if it's 0 or NaN
+  JumpIfZero,
+  // pop the callee's arguments, last on top, and push what it returns
+  Call,
+  // return what the callee returns, in the caller's frame
+  TailCall,
+  Return,
+};
+
+struct Instruction {
+  Op op;
+  uint32_t operand;
+};
+
+struct Function {
+  // the most slots a frame can have
+  static constexpr unsigned max_slots = 1 << 16;
+
+  std::string name;
+  unsigned arity = 0;
+  // in a frame, the arguments' first
+  unsigned slots = 0;
+  std::vector<double> constants;
+  // empty for an extern
+  std::vector<Instruction> code;
+
+  bool is_extern() const { return code.empty(); }
+};
+
+struct Program {
+  std::vector<Function> functions;
+  // the top level expressions, functions of no arguments, in source order
+  std::vector<uint32_t> expressions;
+
+  // what a function is called in object code: its own name unless another
+  // definition has it too, in which case the index is appended
+  std::string symbol(uint32_t function) const;
+  // the functions function calls, itself included, and the ones they call
+  std::vector<uint32_t> reachable(uint32_t function) const;
+};
+
+struct Unsupported : std::exception {
+  char const *what() const noexcept override;
+};
+
+// Lowers statements, as parsed and simplified, into a program.
+class Writer {
+  struct Variable {
+    Symbol name;
+    unsigned slot;
+    bool assignable;
+  };
+
+  Program &program;
+  // what's being written, and the variables in scope there, innermost last
+  uint32_t function;
+  llvm::SmallVector<Variable, 8> scope;
+  // the latest definition of each name, and the latest extern
+  llvm::DenseMap<Symbol, uint32_t> definitions, externs;
+  // calls waiting for the next definition of their callee, as the function
+  // and instruction they're at, and their number of arguments
+  struct Call {
+    uint32_t function, at;
+    size_t arguments;
+  };
+  llvm::DenseMap<Symbol, std::vector<Call>> forward;
+
+  Function &current() { return program.functions[function]; }
+  // point call at callee, if it takes as many arguments as it passes
+  void resolve(Call call, uint32_t callee);
+
+public:
+  explicit Writer(Program &program);
+
+  // lower a definition, extern or top level expression
+  void add(ast::Expr &statement);
+  // bind the calls still waiting for a definition to externs
+  void finish();
+
+  // for the syntax trees' emit(). emit returns where the instruction is.
+  size_t emit(Op op, uint32_t operand = 0);
+  size_t position() const;
+  // make the jump at at go to the current position
+  void patch(size_t at);
+  void constant(double value);
+  // a new slot for name, in scope until unbind()
+  unsigned bind(Symbol name, bool assignable);
+  void unbind();
+  // the slot of the innermost variable called name
+  unsigned lookup(Symbol name, bool to_assign) const;
+  void call(Symbol callee, size_t arguments);
+};
+
+// check that every operand and frame size is in range and every path through
+// each function
+// leaves one value on the stack to return, with the stack as deep wherever
+// paths meet. the interpreter and codegen take that for granted.
+llvm::Error verify(Program const &program);
+
+// the depth of the stack before each instruction of a verified function,
+// unreachable for those no path reaches, and the deepest it gets
+constexpr unsigned unreachable = ~0u;
+std::vector<unsigned> stack_depths(Program const &program, uint32_t function,
+                                   unsigned &max);
+
+// a little endian encoding, which read() verifies
+void write(Program const &program, llvm::raw_ostream &out);
+llvm::Expected<Program> read(llvm::StringRef data);
+
+// the program lowered from source, simplified or not, if it's cached in
+// directory, and caching it there. entries are keyed by a hash of the source,
+// whether it was simplified and the format's version, and written the way
+// DiskObjectCache writes objects.
+std::optional<Program> load_cached(llvm::StringRef directory,
+                                   llvm::StringRef source, bool simplified);
+void store_cached(llvm::StringRef directory, llvm::StringRef source,
+                  bool simplified, Program const &program);
+
+// define each of functions in ctx's module under its symbol(), declaring what
+// they call, for a jit to take over from the interpreter
+void codegen(Program const &program, llvm::ArrayRef<uint32_t> functions,
+             CodegenContext &ctx);
+
+} // namespace bytecode
+
+#endif
@@ -0,0 +1,144 @@
+#include "Bytecode.hpp"
+#include "Parser.hpp"
+#include "llvm/IR/Constants.h"
+
+// Bytecode back to IR, for the functions the interpreter hands to the jit.
+//
+// The frame's slots and the stack's entries become allocas, which mem2reg
+// turns back into registers at -O1 and up; where paths meet the stack is as
+// deep on each, so the same alloca holds the same entry.
+
+namespace bytecode {
+
+void codegen(Program const &program, llvm::ArrayRef<uint32_t> functions,
+             CodegenContext &ctx) {
+  auto &builder = *ctx.builder;
+  auto number = builder.getDoubleTy();
+
+  // each function under its symbol, declared the first time it's needed
+  auto get_function = [&](uint32_t index) {
+    auto name = program.symbol(index);
+    if (auto f = ctx.module->getFunction(name))
+      return f;
+    auto type = ctx.get_type({program.functions[index].arity, 0});
+    return llvm::Function::Create(type, llvm::Function::ExternalLinkage, name,
+                                  ctx.module.get());
+  };
+
+  for (auto index : functions) {
+    auto &f = program.functions[index];
+    auto func = get_function(index);
+    unsigned max;
+    auto depths = stack_depths(program, index, max);
+
+    auto entry = llvm::BasicBlock::Create(*ctx.ctx, "entry", func);
+    builder.SetInsertPoint(entry);
+    std::vector<llvm::AllocaInst *> slots, stack;
+    for (unsigned i = 0; i < f.slots; ++i)
+      slots.push_back(builder.CreateAlloca(number, nullptr, "slot"));
+    for (unsigned i = 0; i < max; ++i)
+      stack.push_back(builder.CreateAlloca(number, nullptr, "stack"));
+    for (auto &arg : func->args())
+      builder.CreateStore(&arg, slots[arg.getArgNo()]);
+    for (unsigned i = f.arity; i < f.slots; ++i)
+      builder.CreateStore(llvm::ConstantFP::get(number, 0.0), slots[i]);
+
+    // a block wherever a jump lands or follows
+    std::vector<llvm::BasicBlock *> blocks(f.code.size());
+    auto block_at = [&](size_t pc) {
+      if (!blocks[pc])
+        blocks[pc] = llvm::BasicBlock::Create(*ctx.ctx, "", func);
+      return blocks[pc];
+    };
+    for (size_t pc = 0; pc < f.code.size(); ++pc) {
+      auto [op, operand] = f.code[pc];
+      if (op == Op::Jump || op == Op::JumpIfZero)
+        block_at(operand);
+      if (op == Op::JumpIfZero)
+        block_at(pc + 1);
+    }
+
+    for (size_t pc = 0; pc < f.code.size(); ++pc) {
+      if (blocks[pc]) {
+        if (!builder.GetInsertBlock()->getTerminator())
+          builder.CreateBr(blocks[pc]);
+        builder.SetInsertPoint(blocks[pc]);
+      }
+      auto d = depths[pc];
+      if (d == unreachable || builder.GetInsertBlock()->getTerminator())
+        continue;
+
+      auto [op, operand] = f.code[pc];
+      auto top = [&](unsigned below) {
+        return builder.CreateLoad(number, stack[d - 1 - below]);
+      };
+      auto set = [&](unsigned at, llvm::Value *value) {
+        builder.CreateStore(value, stack[at]);
+      };
+      switch (op) {
+      case Op::Constant:
+        set(d, llvm::ConstantFP::get(number, f.constants[operand]));
+        break;
+      case Op::Load:
+        set(d, builder.CreateLoad(number, slots[operand]));
+        break;
+      case Op::Store:
+        builder.CreateStore(top(0), slots[operand]);
+        break;
+      case Op::Pop:
+        break;
+      case Op::Add:
+        set(d - 2, builder.CreateFAdd(top(1), top(0), "addtmp"));
+        break;
+      case Op::Subtract:
+        set(d - 2, builder.CreateFSub(top(1), top(0), "subtmp"));
+        break;
+      case Op::Multiply:
+        set(d - 2, builder.CreateFMul(top(1), top(0), "multmp"));
+        break;
+      case Op::Less:
+        set(d - 2, builder.CreateUIToFP(
+                       builder.CreateFCmpULT(top(1), top(0), "cmptmp"), number,
+                       "booltmp"));
+        break;
+      case Op::Jump:
+        builder.CreateBr(block_at(operand));
+        break;
+      case Op::JumpIfZero:
+        builder.CreateCondBr(
+            builder.CreateFCmpONE(top(0), llvm::ConstantFP::get(number, 0.0),
+                                  "ifcond"),
+            block_at(pc + 1), block_at(operand));
+        break;
+      case Op::Call:
+      case Op::TailCall: {
+        auto callee = get_function(operand);
+        auto arity = program.functions[operand].arity;
+        std::vector<llvm::Value *> args;
+        for (unsigned i = arity; i > 0; --i)
+          args.push_back(top(i - 1));
+        auto call = builder.CreateCall(callee, args, "calltmp");
+        if (op == Op::Call) {
+          set(d - arity, call);
+          break;
+        }
+        call->setTailCallKind(callee->getFunctionType() ==
+                                      func->getFunctionType()
+                                  ? llvm::CallInst::TCK_MustTail
+                                  : llvm::CallInst::TCK_Tail);
+        builder.CreateRet(call);
+        break;
+      }
+      case Op::Return:
+        builder.CreateRet(top(0));
+        break;
+      }
+    }
+    // a block only unreachable code follows
+    if (!builder.GetInsertBlock()->getTerminator())
+      builder.CreateUnreachable();
+    verifyFunction(*func);
+  }
+}
+
+} // namespace bytecode
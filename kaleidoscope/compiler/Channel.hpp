@@ -0,0 +1,72 @@
+#ifndef CHANNEL_HPP
+#define CHANNEL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// A blocking queue for handing work between threads, in order.
+//
+// Consumers call done() once they have finished with an item they popped, so
+// producers can join() to wait for everything pushed so far to be handled.
+template <typename T> class Channel {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<T> items;
+  size_t capacity;
+  size_t unfinished = 0;
+  bool closed = false;
+
+public:
+  // a capacity of 0 is unbounded
+  explicit Channel(size_t capacity = 0) : capacity(capacity) {}
+
+  // blocks while the channel is full. returns false if it has been closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] {
+      return closed || capacity == 0 || items.size() < capacity;
+    });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    ++unfinished;
+    changed.notify_all();
+    return true;
+  }
+
+  // blocks until there is an item. returns nothing once the channel is closed
+  // and empty.
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return closed || !items.empty(); });
+    if (items.empty())
+      return std::nullopt;
+    auto item = std::move(items.front());
+    items.pop_front();
+    changed.notify_all();
+    return item;
+  }
+
+  void done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    --unfinished;
+    changed.notify_all();
+  }
+
+  // wait until every item pushed so far has been popped and done()
+  void join() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return closed || unfinished == 0; });
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    changed.notify_all();
+  }
+};
+
+#endif
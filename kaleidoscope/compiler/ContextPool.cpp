@@ -0,0 +1,14 @@
+#include "ContextPool.hpp"
+#include "llvm/IR/LLVMContext.h"
+#include <memory>
+
+ContextPool::ContextPool(unsigned size) {
+  for (unsigned i = 0; i < size; ++i)
+    contexts.emplace_back(std::make_unique<llvm::LLVMContext>());
+}
+
+llvm::orc::ThreadSafeContext ContextPool::get() {
+  if (contexts.empty())
+    return llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+  return contexts[next++ % contexts.size()];
+}
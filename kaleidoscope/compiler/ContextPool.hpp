@@ -0,0 +1,24 @@
+#ifndef CONTEXT_POOL_HPP
+#define CONTEXT_POOL_HPP
+
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include <atomic>
+#include <vector>
+
+// LLVM contexts for codegen to share between statements, so each one's types
+// and constants are uniqued once for the pool instead of once per statement.
+//
+// Contexts are handed out in turn. A module in one may be compiling on another
+// thread, so it's only used with its lock held. An empty pool makes a new
+// context every time.
+class ContextPool {
+  std::vector<llvm::orc::ThreadSafeContext> contexts;
+  std::atomic<size_t> next{0};
+
+public:
+  explicit ContextPool(unsigned size);
+
+  llvm::orc::ThreadSafeContext get();
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "Engine.hpp"
+#include "Lexer.hpp"
+#include "Optimizer.hpp"
+#include "Runtime.hpp"
+#include "llvm/Support/TargetSelect.h"
+#include <algorithm>
+#include <optional>
+#include <utility>
+
+template <typename... Ts>
+static llvm::Error error(char const *format, Ts const &...values) {
+  return llvm::createStringError(llvm::inconvertibleErrorCode(), format,
+                                 values...);
+}
+
+Engine::Handle::Handle(Engine *engine, llvm::orc::ResourceTrackerSP tracker,
+                       std::vector<Symbol> names)
+    : engine(engine), tracker(std::move(tracker)), names(std::move(names)) {}
+
+Engine::Handle::Handle(Handle &&that)
+    : engine(std::exchange(that.engine, nullptr)),
+      tracker(std::move(that.tracker)), names(std::move(that.names)) {}
+
+Engine::Handle &Engine::Handle::operator=(Handle &&that) {
+  if (engine)
+    engine->release(*this);
+  engine = std::exchange(that.engine, nullptr);
+  tracker = std::move(that.tracker);
+  names = std::move(that.names);
+  return *this;
+}
+
+Engine::Handle::~Handle() {
+  if (engine)
+    engine->release(*this);
+}
+
+Engine::Engine(std::unique_ptr<llvm::orc::LLJIT> jit) : jit(std::move(jit)) {}
+
+Engine::~Engine() = default;
+
+llvm::Expected<std::unique_ptr<Engine>> Engine::create(unsigned opt_level) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit)
+    return jit.takeError();
+  Optimizer::install(**jit, opt_level);
+
+  // externs are found among the runtime's symbols, then in the process
+  if (auto err = link_runtime(**jit))
+    return std::move(err);
+
+  return std::unique_ptr<Engine>(new Engine(std::move(*jit)));
+}
+
+void Engine::release(Handle &handle) {
+  for (auto name : handle.names) {
+    defined.erase(name);
+    signatures.erase(name);
+  }
+  if (auto err = handle.tracker->remove())
+    jit->getExecutionSession().reportError(std::move(err));
+  handle.engine = nullptr;
+}
+
+llvm::Expected<Engine::Handle> Engine::compile(llvm::StringRef source) {
+  static auto const anon_expr = Symbol::intern("__anon_expr");
+
+  std::vector<Symbol> names;
+  // the signatures this source declared or defined, as they were before it. a
+  // source that fails leaves the table as it found it.
+  llvm::DenseMap<Symbol, std::optional<Signature>> previous;
+  auto forget = [&] {
+    for (auto &[name, signature] : previous)
+      if (signature)
+        signatures[name] = *signature;
+      else
+        signatures.erase(name);
+  };
+
+  CodegenContext ctx(jit.get(), &signatures);
+  Lexer lexer(std::string_view(source.data(), source.size()));
+  Parser parser;
+  for (;;) {
+    ast::Arena arena;
+    ast::Expr *ast;
+    try {
+      ast = parser.parse(lexer, arena);
+    } catch (Parser::ParseError const &) {
+      forget();
+      auto location = parser.peek_location();
+      return error("Unexpected token at %u:%u", location.line,
+                   location.column);
+    }
+    if (!ast)
+      break;
+    ast = ast->simplify(arena);
+
+    auto offset = parser.get_statement_offset();
+    auto function = llvm::dyn_cast<ast::Function>(ast);
+    auto prototype = function ? &function->get_prototype()
+                              : llvm::dyn_cast<ast::Prototype>(ast);
+    auto name = prototype->get_name();
+    bool live = defined.count(name) ||
+                std::find(names.begin(), names.end(), name) != names.end();
+    if (function) {
+      if (name == anon_expr) {
+        forget();
+        return error("Top level expression at offset %zu; only definitions "
+                     "and externs can be compiled",
+                     offset);
+      }
+      if (live) {
+        forget();
+        return error("Redefinition at offset %zu of a function that's still "
+                     "defined",
+                     offset);
+      }
+      names.push_back(name);
+    } else if (live && signatures[name] != prototype->get_signature()) {
+      // callers and lookups would call the definition as the extern's type
+      forget();
+      return error("Extern at offset %zu doesn't match the arguments of the "
+                   "function it declares",
+                   offset);
+    }
+    if (!previous.count(name)) {
+      auto known = signatures.find(name);
+      previous[name] = known == signatures.end()
+                           ? std::nullopt
+                           : std::optional<Signature>(known->second);
+    }
+
+    try {
+      ast->codegen(ctx);
+    } catch (CodegenException const &) {
+      forget();
+      return error("Codegen error in the statement at offset %zu", offset);
+    }
+  }
+
+  auto tracker = jit->getMainJITDylib().createResourceTracker();
+  if (auto err = jit->addIRModule(tracker, ctx.take_module())) {
+    forget();
+    return std::move(err);
+  }
+  defined.insert(names.begin(), names.end());
+  return Handle(this, std::move(tracker), std::move(names));
+}
+
+llvm::Expected<void *> Engine::lookup(llvm::StringRef name,
+                                      std::string const &kinds) {
+  auto signature = signatures.find(Symbol::intern(name));
+  if (signature == signatures.end())
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "No function %s", name.str().c_str());
+
+  std::string expected;
+  for (unsigned i = 0; i < signature->second.arity; ++i)
+    expected += signature->second.is_array(i) ? "pi" : "d";
+  if (kinds != expected)
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "%s isn't a function of that type",
+                                   name.str().c_str());
+
+  auto symbol = jit->lookup(name);
+  if (!symbol)
+    return symbol.takeError();
+  auto address = *symbol;
+  return address.toPtr<void *>();
+}
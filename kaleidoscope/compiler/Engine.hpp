@@ -0,0 +1,97 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include "Parser.hpp"
+#include "Symbol.hpp"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Kaleidoscope compiled into a host program, and called through plain function
+// pointers:
+//
+//   auto engine = ExitOnErr(Engine::create());
+//   auto handle = ExitOnErr(engine->compile("def f(x y) x * y + 1;"));
+//   auto f = ExitOnErr(engine->lookup<double(double, double)>("f"));
+//   f(2, 3);
+//
+// compile() takes definitions and externs; top level expressions are an
+// error. A function stays until the handle of the source that defined it is
+// destroyed, and can't be defined again, or declared with other arguments,
+// until then. A source that fails changes nothing. Nothing stops other
+// sources calling it, so they have to go first. An array parameter is a
+// double * and an int64_t length, as in HostCall.hpp.
+//
+// compile(), lookup() and destroying handles aren't thread safe, but the
+// functions can be called from any thread.
+class Engine {
+public:
+  // removes a compiled source's functions. the engine has to outlive it.
+  class Handle {
+    Engine *engine = nullptr;
+    llvm::orc::ResourceTrackerSP tracker;
+    std::vector<Symbol> names;
+
+    friend class Engine;
+    Handle(Engine *engine, llvm::orc::ResourceTrackerSP tracker,
+           std::vector<Symbol> names);
+
+  public:
+    Handle() = default;
+    Handle(Handle &&that);
+    Handle &operator=(Handle &&that);
+    ~Handle();
+  };
+
+private:
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  SignatureTable signatures;
+  // what the live handles define
+  llvm::DenseSet<Symbol> defined;
+
+  Engine(std::unique_ptr<llvm::orc::LLJIT> jit);
+
+  void release(Handle &handle);
+
+  // the parameters of a function type, double as 'd', double * as 'p' and
+  // int64_t as 'i'
+  template <typename T> static constexpr char kind() {
+    static_assert(std::is_same_v<T, double> || std::is_same_v<T, double *> ||
+                      std::is_same_v<T, int64_t>,
+                  "Kaleidoscope functions take doubles and arrays");
+    return std::is_same_v<T, double> ? 'd' : std::is_same_v<T, double *> ? 'p'
+                                                                         : 'i';
+  }
+  template <typename F> struct Kinds;
+  template <typename... Params> struct Kinds<double(Params...)> {
+    static std::string get() { return {kind<Params>()...}; }
+  };
+
+  llvm::Expected<void *> lookup(llvm::StringRef name,
+                                std::string const &kinds);
+
+public:
+  // compiled at opt_level (0-3) for the host
+  static llvm::Expected<std::unique_ptr<Engine>> create(unsigned opt_level = 2);
+  ~Engine();
+
+  llvm::Expected<Handle> compile(llvm::StringRef source);
+
+  // f compiled as F, a double returning function type. its code is compiled
+  // on the first lookup of anything in its source.
+  template <typename F> llvm::Expected<F *> lookup(llvm::StringRef name) {
+    auto address = lookup(name, Kinds<F>::get());
+    if (!address)
+      return address.takeError();
+    return reinterpret_cast<F *>(*address);
+  }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef HOST_CALL_HPP
+#define HOST_CALL_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+// Calling jitted functions with arrays in host memory, in place. An
+// llvm::MutableArrayRef<double> argument is passed as the pointer and length
+// an array parameter takes, and doubles as they are, so
+//
+//   def scale(xs[] k) for i = 0, i < len(xs) - 1 in xs[i] = xs[i] * k;
+//
+// scales a std::vector<double> xs with
+//
+//   call(scale, xs, 2.0);
+//
+// without copying it. Nothing checks the arguments against the prototype.
+
+namespace host_call {
+template <typename... Flat>
+double call_flat(void *function, std::tuple<Flat...> flat) {
+  return std::apply(
+      [function](Flat... args) {
+        return reinterpret_cast<double (*)(Flat...)>(function)(args...);
+      },
+      flat);
+}
+
+template <typename... Flat, typename... Rest>
+double call_flat(void *function, std::tuple<Flat...> flat, double x,
+                 Rest &&...rest);
+template <typename... Flat, typename... Rest>
+double call_flat(void *function, std::tuple<Flat...> flat,
+                 llvm::MutableArrayRef<double> xs, Rest &&...rest);
+
+template <typename... Flat, typename... Rest>
+double call_flat(void *function, std::tuple<Flat...> flat, double x,
+                 Rest &&...rest) {
+  return call_flat(function, std::tuple_cat(flat, std::tuple<double>(x)),
+                   std::forward<Rest>(rest)...);
+}
+
+template <typename... Flat, typename... Rest>
+double call_flat(void *function, std::tuple<Flat...> flat,
+                 llvm::MutableArrayRef<double> xs, Rest &&...rest) {
+  return call_flat(function,
+                   std::tuple_cat(flat, std::tuple<double *, int64_t>(
+                                            xs.data(), xs.size())),
+                   std::forward<Rest>(rest)...);
+}
+} // namespace host_call
+
+template <typename... Args> double call(void *function, Args &&...args) {
+  return host_call::call_flat(function, std::tuple<>(),
+                              std::forward<Args>(args)...);
+}
+
+#endif
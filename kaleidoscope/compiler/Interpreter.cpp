@@ -0,0 +1,180 @@
+#include "Interpreter.hpp"
+#include "Runtime.hpp"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+using bytecode::Op;
+
+Interpreter::Interpreter(bytecode::Program const &program, unsigned threshold,
+                         Compile compile)
+    : program(program), threshold(compile ? threshold : 0),
+      compile(std::move(compile)), native(program.functions.size()),
+      compiled(program.functions.size()), calls(program.functions.size()) {}
+
+llvm::Error Interpreter::link() {
+  // externs only declaring a later definition, or never called, go unlinked
+  std::vector<bool> called(program.functions.size());
+  for (auto &f : program.functions)
+    for (auto &instruction : f.code)
+      if (instruction.op == Op::Call || instruction.op == Op::TailCall)
+        called[instruction.operand] = true;
+
+  for (size_t i = 0; i < program.functions.size(); ++i) {
+    auto &f = program.functions[i];
+    if (!f.is_extern() || !called[i])
+      continue;
+    if (f.arity > max_native_arity)
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "Can't call extern %s with more than %u "
+                                     "arguments",
+                                     f.name.c_str(), max_native_arity);
+    native[i] = find_runtime_symbol(f.name);
+    if (!native[i])
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "Can't find extern %s", f.name.c_str());
+  }
+  return llvm::Error::success();
+}
+
+// function(args[0], ..., args[arity - 1])
+static double call_native(void *function, double const *args, unsigned arity) {
+  using D = double;
+  switch (arity) {
+  case 0:
+    return reinterpret_cast<D (*)()>(function)();
+  case 1:
+    return reinterpret_cast<D (*)(D)>(function)(args[0]);
+  case 2:
+    return reinterpret_cast<D (*)(D, D)>(function)(args[0], args[1]);
+  case 3:
+    return reinterpret_cast<D (*)(D, D, D)>(function)(args[0], args[1],
+                                                      args[2]);
+  case 4:
+    return reinterpret_cast<D (*)(D, D, D, D)>(function)(args[0], args[1],
+                                                         args[2], args[3]);
+  case 5:
+    return reinterpret_cast<D (*)(D, D, D, D, D)>(function)(
+        args[0], args[1], args[2], args[3], args[4]);
+  case 6:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D)>(function)(
+        args[0], args[1], args[2], args[3], args[4], args[5]);
+  }
+  llvm_unreachable("too many arguments for machine code");
+}
+
+void Interpreter::hand_off(uint32_t function) {
+  std::vector<uint32_t> functions;
+  for (auto f : program.reachable(function))
+    if (!compiled[f] && !program.functions[f].is_extern())
+      functions.push_back(f);
+
+  auto addresses = compile(functions);
+  if (!addresses) {
+    // keep interpreting, without trying again
+    llvm::errs() << "Failed to compile " << program.functions[function].name
+                 << ": " << llvm::toString(addresses.takeError()) << '\n';
+    threshold = 0;
+    return;
+  }
+  for (size_t i = 0; i < functions.size(); ++i) {
+    auto f = functions[i];
+    compiled[f] = true;
+    if (program.functions[f].arity <= max_native_arity)
+      native[f] = (*addresses)[i];
+  }
+}
+
+void Interpreter::call(uint32_t function) {
+  auto &f = program.functions[function];
+  if (!native[function] && ++calls[function] == threshold)
+    hand_off(function);
+
+  auto args = values.size() - f.arity;
+  if (native[function]) {
+    auto value = call_native(native[function], values.data() + args, f.arity);
+    values.resize(args);
+    values.push_back(value);
+    return;
+  }
+  frames.push_back({function, 0, args});
+  values.resize(args + f.slots);
+}
+
+double Interpreter::run(uint32_t function) {
+  frames.clear();
+  values.clear();
+  call(function);
+
+  while (!frames.empty()) {
+    auto &frame = frames.back();
+    auto &f = program.functions[frame.function];
+    auto [op, operand] = f.code[frame.pc++];
+
+    auto binary = [&](auto result) {
+      auto rhs = values.back();
+      values.pop_back();
+      values.back() = result(values.back(), rhs);
+    };
+    switch (op) {
+    case Op::Constant:
+      values.push_back(f.constants[operand]);
+      break;
+    case Op::Load:
+      values.push_back(values[frame.base + operand]);
+      break;
+    case Op::Store:
+      values[frame.base + operand] = values.back();
+      break;
+    case Op::Pop:
+      values.pop_back();
+      break;
+    case Op::Add:
+      binary([](double l, double r) { return l + r; });
+      break;
+    case Op::Subtract:
+      binary([](double l, double r) { return l - r; });
+      break;
+    case Op::Multiply:
+      binary([](double l, double r) { return l * r; });
+      break;
+    case Op::Less:
+      // fcmp ult, which is true when either is NaN
+      binary([](double l, double r) { return !(l >= r) ? 1.0 : 0.0; });
+      break;
+    case Op::Jump:
+      frame.pc = operand;
+      break;
+    case Op::JumpIfZero: {
+      // fcmp one against 0, which is false for NaN
+      auto condition = values.back();
+      values.pop_back();
+      if (!(condition < 0 || condition > 0))
+        frame.pc = operand;
+      break;
+    }
+    case Op::Call:
+      // invalidates frame
+      call(operand);
+      break;
+    case Op::TailCall: {
+      // the arguments take the frame's place, and the callee's value is left
+      // where a return would leave it
+      auto arity = program.functions[operand].arity;
+      auto base = frame.base;
+      std::move(values.end() - arity, values.end(), values.begin() + base);
+      values.resize(base + arity);
+      frames.pop_back();
+      call(operand);
+      break;
+    }
+    case Op::Return: {
+      auto value = values.back();
+      values.resize(frame.base);
+      values.push_back(value);
+      frames.pop_back();
+      break;
+    }
+    }
+  }
+  return values.back();
+}
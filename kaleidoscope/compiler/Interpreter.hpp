@@ -0,0 +1,68 @@
+#ifndef INTERPRETER_HPP
+#define INTERPRETER_HPP
+
+#include "Bytecode.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Runs a verified bytecode program as it is, for scripts that would spend
+// longer setting up a jit than running.
+//
+// Each definition counts its calls, and the call that takes one to threshold
+// hands it and every definition it can reach to compile(), which returns
+// their machine code in the same order. Later calls to them from the
+// interpreter go straight there. What's already running stays interpreted, so
+// a loop in a function called once never leaves the interpreter.
+//
+// Frames live on a stack of the interpreter's own, so recursion isn't limited
+// by the host's, and tail calls reuse their caller's frame.
+class Interpreter {
+public:
+  using Compile = std::function<llvm::Expected<std::vector<void *>>(
+      llvm::ArrayRef<uint32_t> functions)>;
+
+  // the most arguments machine code can be called with from here
+  static constexpr unsigned max_native_arity = 6;
+
+private:
+  bytecode::Program const &program;
+  unsigned threshold;
+  Compile compile;
+  // the machine code to call for each function, if any, whether it's been
+  // compiled, and how often it's been called since
+  std::vector<void *> native;
+  std::vector<bool> compiled;
+  std::vector<unsigned> calls;
+
+  struct Frame {
+    uint32_t function;
+    size_t pc;
+    // where its slots start in values, with its stack after them
+    size_t base;
+  };
+  std::vector<Frame> frames;
+  std::vector<double> values;
+
+  // compile function and what it calls
+  void hand_off(uint32_t function);
+  // call function with the arguments on top of the stack: in machine code,
+  // replacing them with its value, or in a new frame
+  void call(uint32_t function);
+
+public:
+  // with no compile, or a threshold of 0, everything is interpreted
+  Interpreter(bytecode::Program const &program, unsigned threshold = 0,
+              Compile compile = nullptr);
+
+  // find the functions of the externs that are called, in the runtime and the
+  // process
+  llvm::Error link();
+
+  // the value of a function of no arguments
+  double run(uint32_t function);
+};
+
+#endif
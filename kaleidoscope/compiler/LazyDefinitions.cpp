@@ -0,0 +1,107 @@
+#include "LazyDefinitions.hpp"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/ErrorHandling.h"
+
+// where a stub goes when its body fails to compile. the session has reported
+// why by then.
+static void lazy_compile_failed() {
+  llvm::report_fatal_error("Failed to compile a lazily compiled function.");
+}
+
+LazyDefinitions::LazyDefinitions(
+    llvm::orc::LLJIT &jit,
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through,
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs,
+    llvm::orc::JITDylib &bodies)
+    : jit(jit), call_through(std::move(call_through)), stubs(std::move(stubs)),
+      bodies(bodies) {}
+
+llvm::Expected<std::unique_ptr<LazyDefinitions>>
+LazyDefinitions::create(llvm::orc::LLJIT &jit) {
+  auto &es = jit.getExecutionSession();
+  auto &triple = jit.getTargetTriple();
+
+  auto call_through = llvm::orc::createLocalLazyCallThroughManager(
+      triple, es, llvm::orc::ExecutorAddr::fromPtr(&lazy_compile_failed));
+  if (!call_through)
+    return call_through.takeError();
+
+  auto stubs_builder =
+      llvm::orc::createLocalIndirectStubsManagerBuilder(triple);
+  if (!stubs_builder)
+    return llvm::make_error<llvm::StringError>(
+        "No indirect stubs for " + triple.str(),
+        llvm::inconvertibleErrorCode());
+
+  // bodies see what main sees, with the stubs in main first
+  auto &main = jit.getMainJITDylib();
+  auto &bodies = es.createBareJITDylib("main.bodies");
+  llvm::orc::JITDylibSearchOrder order = {
+      {&main, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}};
+  main.withLinkOrderDo([&](llvm::orc::JITDylibSearchOrder const &links) {
+    for (auto &link : links)
+      if (link.first != &main)
+        order.push_back(link);
+  });
+  bodies.setLinkOrder(std::move(order), false);
+
+  return std::unique_ptr<LazyDefinitions>(new LazyDefinitions(
+      jit, std::move(*call_through), stubs_builder(), bodies));
+}
+
+llvm::orc::JITDylib &LazyDefinitions::get_bodies() const { return bodies; }
+
+llvm::Error LazyDefinitions::add(llvm::orc::ResourceTrackerSP body_tracker,
+                                 llvm::orc::ThreadSafeModule module) {
+  llvm::orc::SymbolAliasMap functions;
+  module.withModuleDo([&](llvm::Module &m) {
+    for (auto &f : m.functions()) {
+      if (f.isDeclaration() || f.hasLocalLinkage())
+        continue;
+      auto name = jit.mangleAndIntern(f.getName());
+      functions[name] = llvm::orc::SymbolAliasMapEntry(
+          name, llvm::JITSymbolFlags::fromGlobalValue(f));
+    }
+  });
+  return add(std::move(body_tracker), std::move(module), std::move(functions));
+}
+
+llvm::Error LazyDefinitions::add(llvm::orc::ResourceTrackerSP body_tracker,
+                                 llvm::orc::ThreadSafeModule module,
+                                 llvm::orc::SymbolAliasMap functions) {
+  if (auto err = jit.addIRModule(std::move(body_tracker), std::move(module)))
+    return err;
+
+  llvm::orc::SymbolMap new_stubs;
+  for (auto &[name, body] : functions) {
+    // the first call finds the body and points the stub straight at it
+    auto trampoline = call_through->getCallThroughTrampoline(
+        bodies, body.Aliasee,
+        [this, name = std::string(*name)](llvm::orc::ExecutorAddr address) {
+          return stubs->updatePointer(name, address);
+        });
+    if (!trampoline)
+      return trampoline.takeError();
+
+    if (stubs->findStub(*name, false).getAddress()) {
+      if (auto err = stubs->updatePointer(*name, *trampoline))
+        return err;
+      continue;
+    }
+    if (auto err = stubs->createStub(*name, *trampoline, body.AliasFlags))
+      return err;
+    new_stubs[name] = stubs->findStub(*name, false);
+  }
+
+  // stubs are never removed, so they live under main's default tracker
+  if (new_stubs.empty())
+    return llvm::Error::success();
+  return jit.getMainJITDylib().define(
+      llvm::orc::absoluteSymbols(std::move(new_stubs)));
+}
+
+llvm::Error LazyDefinitions::redirect(llvm::StringRef name,
+                                      llvm::orc::ExecutorAddr body) {
+  return stubs->updatePointer(*jit.mangleAndIntern(name), body);
+}
@@ -0,0 +1,61 @@
+#ifndef LAZY_DEFINITIONS_HPP
+#define LAZY_DEFINITIONS_HPP
+
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#include <memory>
+
+// Functions that are called through stubs, so they can be redefined under
+// code that already calls them.
+//
+// Each function gets an indirect stub in the jit's main dylib the first time
+// it is defined, which stays there for good. Its body goes into a separate
+// dylib of bodies, and the stub starts out pointing at a lazy call-through
+// trampoline, so the body is only optimized and compiled when it's first
+// called. Bodies resolve their own calls through main, so compiling one doesn't
+// pull in the functions it calls.
+//
+// Once the old body has been removed, defining a function again points the same
+// stub at the new body. Everything compiled against the old one then calls the
+// new one, without being recompiled itself.
+//
+// Unlike a CompileOnDemandLayer, the bodies are added under a tracker of the
+// caller's, so a definition can be removed and replaced like an eager one.
+class LazyDefinitions {
+  llvm::orc::LLJIT &jit;
+  std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+  llvm::orc::JITDylib &bodies;
+
+  LazyDefinitions(
+      llvm::orc::LLJIT &jit,
+      std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through,
+      std::unique_ptr<llvm::orc::IndirectStubsManager> stubs,
+      llvm::orc::JITDylib &bodies);
+
+public:
+  static llvm::Expected<std::unique_ptr<LazyDefinitions>>
+  create(llvm::orc::LLJIT &jit);
+
+  // the dylib to create body trackers from
+  llvm::orc::JITDylib &get_bodies() const;
+
+  // add the module under body_tracker (which has to be on get_bodies()), and
+  // point the stubs of its functions at it
+  llvm::Error add(llvm::orc::ResourceTrackerSP body_tracker,
+                  llvm::orc::ThreadSafeModule module);
+
+  // the same, with the stubs named and flagged by functions, which maps each
+  // stub to the name of a body in the module
+  llvm::Error add(llvm::orc::ResourceTrackerSP body_tracker,
+                  llvm::orc::ThreadSafeModule module,
+                  llvm::orc::SymbolAliasMap functions);
+
+  // point the stub for a function at another body
+  llvm::Error redirect(llvm::StringRef name, llvm::orc::ExecutorAddr body);
+};
+
+#endif
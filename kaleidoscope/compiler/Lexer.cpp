@@ -0,0 +1,116 @@
+#include "Lexer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+Token TokenView::to_token() const {
+  return {type, std::string(literal), number, symbol};
+}
+
+Lexer::Lexer(std::string_view source)
+    : source(source), position(0), line(1), line_start(0) {}
+
+Lexer::Lexer(std::string_view source, size_t position)
+    : source(source), position(position),
+      line(1 + std::count(source.begin(), source.begin() + position, '\n')),
+      line_start(position ? source.rfind('\n', position - 1) + 1 : 0) {}
+
+std::string_view Lexer::get_source() const { return source; }
+
+size_t Lexer::get_position() const { return position; }
+
+static bool is(int (*predicate)(int), char c) {
+  return predicate(static_cast<unsigned char>(c));
+}
+
+TokenView Lexer::next() {
+  auto const size = source.size();
+
+  // skip whitespace
+  for (; position < size && is(isspace, source[position]); ++position) {
+    if (source[position] == '\n') {
+      ++line;
+      line_start = position + 1;
+    }
+  }
+
+  SourceLocation location{line, unsigned(position - line_start + 1)};
+  if (position == size)
+    return {Token::TypeEOF, "EOF", 0, size, location, {}};
+
+  auto const start = position;
+  auto const c = source[position++];
+  auto token = [&](Token::Type type) -> TokenView {
+    return {type, source.substr(start, position - start), 0, start, location,
+            {}};
+  };
+
+  // identifier: [a-Z][0-9a-Z]*
+  if (is(isalpha, c)) {
+    while (position < size && is(isalnum, source[position]))
+      ++position;
+
+    static constexpr std::pair<std::string_view, Token::Type> special_ids[] = {
+        {"def", Token::TypeDef},   {"extern", Token::TypeExtern},
+        {"if", Token::TypeIf},     {"then", Token::TypeThen},
+        {"else", Token::TypeElse}, {"for", Token::TypeFor},
+        {"in", Token::TypeIn},     {"var", Token::TypeVar},
+    };
+
+    auto t = token(Token::TypeIdentifier);
+    for (auto &[id, type] : special_ids) {
+      if (t.literal == id) {
+        t.type = type;
+        return t;
+      }
+    }
+    t.symbol = Symbol::intern({t.literal.data(), t.literal.size()});
+    return t;
+  }
+
+  // number: [0-9]*(\.[0-9]*)?
+  if (is(isdigit, c) || c == '.') {
+    position = start;
+    while (position < size && is(isdigit, source[position]))
+      ++position;
+
+    if (position < size && source[position] == '.') {
+      do {
+        ++position;
+      } while (position < size && is(isdigit, source[position]));
+    }
+
+    auto t = token(Token::TypeNumber);
+    auto end = t.literal.data() + t.literal.size();
+    auto [ptr, ec] = std::from_chars(t.literal.data(), end, t.number);
+    if (ec != std::errc{} || ptr != end)
+      t.type = Token::TypeError;
+    return t;
+  }
+
+  switch (c) {
+  case '(':
+    return token(Token::TypeLpar);
+  case ')':
+    return token(Token::TypeRpar);
+  case '[':
+    return token(Token::TypeLbracket);
+  case ']':
+    return token(Token::TypeRbracket);
+  case ';':
+    return token(Token::TypeSemicolon);
+  case ',':
+    return token(Token::TypeComma);
+  }
+
+  while (position < size) {
+    auto d = source[position];
+    if (is(isspace, d) || is(isalnum, d) || d == '.' || d == '(' || d == ')' ||
+        d == '[' || d == ']' || d == ';')
+      break;
+    ++position;
+  }
+  auto t = token(Token::TypeOperator);
+  t.symbol = Symbol::intern({t.literal.data(), t.literal.size()});
+  return t;
+}
@@ -0,0 +1,49 @@
+#ifndef LEXER_HPP
+#define LEXER_HPP
+
+#include "Token.hpp"
+#include <cstddef>
+#include <string_view>
+
+// where a token starts, counting from 1
+struct SourceLocation {
+  unsigned line = 0, column = 0;
+};
+
+// A token whose literal points into the source it was lexed from.
+struct TokenView {
+  Token::Type type;
+  std::string_view literal;
+  double number;
+  // where literal starts in the source
+  size_t offset;
+  SourceLocation location;
+  // the interned literal of identifiers and operators
+  Symbol symbol;
+
+  // an owning copy, as read by operator>>(std::istream &, Token &)
+  Token to_token() const;
+};
+
+// Lexes a contiguous buffer without copying it. Produces the same tokens as
+// operator>>(std::istream &, Token &); the buffer has to outlive the tokens.
+class Lexer {
+  std::string_view source;
+  size_t position;
+  // of position, and where its line starts
+  unsigned line;
+  size_t line_start;
+
+public:
+  Lexer(std::string_view source);
+  // starting at position, so offsets are still into all of source
+  Lexer(std::string_view source, size_t position);
+
+  // returns TypeEOF tokens once the source is exhausted
+  TokenView next();
+
+  std::string_view get_source() const;
+  size_t get_position() const;
+};
+
+#endif
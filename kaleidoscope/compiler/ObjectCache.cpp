@@ -0,0 +1,111 @@
+#include "ObjectCache.hpp"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+
+static char const *const key_metadata = "kaleidoscope.cache_key";
+
+DiskObjectCache::DiskObjectCache(std::string directory, unsigned opt_level)
+    : directory(std::move(directory)), opt_level(opt_level) {}
+
+void DiskObjectCache::install(llvm::orc::LLJITBuilder &builder) {
+  builder.setCompileFunctionCreator(
+      [this](llvm::orc::JITTargetMachineBuilder jtmb)
+          -> llvm::Expected<
+              std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+        // objects are only valid for the exact target they were built for
+        target = jtmb.getTargetTriple().str() + " " + jtmb.getCPU() + " " +
+                 jtmb.getFeatures().getString();
+        return std::make_unique<llvm::orc::ConcurrentIRCompiler>(
+            std::move(jtmb), this);
+      });
+}
+
+std::string DiskObjectCache::key(llvm::Module const &module) const {
+  if (auto tagged = module.getNamedMetadata(key_metadata))
+    return std::string(
+        llvm::cast<llvm::MDString>(tagged->getOperand(0)->getOperand(0))
+            ->getString());
+
+  std::string ir;
+  llvm::raw_string_ostream os(ir);
+  os << target << '\n' << opt_level << '\n';
+  module.print(os, nullptr);
+  os.flush();
+
+  return llvm::toHex(llvm::SHA256::hash(llvm::arrayRefFromStringRef(ir)),
+                     true);
+}
+
+std::string DiskObjectCache::path(std::string const &key) const {
+  llvm::SmallString<128> path(directory);
+  llvm::sys::path::append(path, key + ".o");
+  return std::string(path);
+}
+
+bool DiskObjectCache::tag(llvm::Module &module) {
+  auto k = key(module);
+  auto &ctx = module.getContext();
+  module.getOrInsertNamedMetadata(key_metadata)
+      ->addOperand(llvm::MDNode::get(ctx, llvm::MDString::get(ctx, k)));
+
+  auto object = llvm::MemoryBuffer::getFile(path(k));
+  if (!object)
+    return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  found[&module] = {std::move(k), std::move(*object)};
+  return true;
+}
+
+void DiskObjectCache::notifyObjectCompiled(llvm::Module const *module,
+                                           llvm::MemoryBufferRef object) {
+  if (llvm::sys::fs::create_directories(directory))
+    return;
+
+  auto final_path = path(key(*module));
+  int fd;
+  llvm::SmallString<128> temporary;
+  if (llvm::sys::fs::createUniqueFile(final_path + ".%%%%%%.tmp", fd,
+                                      temporary))
+    return;
+
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    out << object.getBuffer();
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(temporary);
+      return;
+    }
+  }
+
+  // rename is atomic, so concurrent readers see either nothing or the whole
+  // object. a concurrent writer of the same key wrote the same object.
+  if (llvm::sys::fs::rename(temporary, final_path))
+    llvm::sys::fs::remove(temporary);
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+DiskObjectCache::getObject(llvm::Module const *module) {
+  auto k = key(*module);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto tagged = found.find(module);
+    if (tagged != found.end()) {
+      auto entry = std::move(tagged->second);
+      found.erase(tagged);
+      // a module freed and another allocated in its place isn't the same
+      if (entry.first == k)
+        return std::move(entry.second);
+    }
+  }
+  auto object = llvm::MemoryBuffer::getFile(path(k));
+  if (!object)
+    return nullptr;
+  return std::move(*object);
+}
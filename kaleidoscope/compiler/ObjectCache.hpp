@@ -0,0 +1,56 @@
+#ifndef OBJECT_CACHE_HPP
+#define OBJECT_CACHE_HPP
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// Object files cached in a directory, keyed by a hash of a module's IR, the
+// target and the optimization level.
+//
+// Modules are keyed by their IR *before* optimization: the Optimizer calls
+// tag() on each module, which records the key in the module and reports
+// whether the object is already cached so the pipeline can be skipped. It
+// reads the object then, and hands that to the compile, so an unoptimized
+// module is never compiled and cached under its optimized key if the file
+// goes away in between. Untagged modules are keyed by their IR as compiled.
+//
+// Entries are written to a unique temporary file and renamed into place, so
+// several processes can share a directory.
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string directory;
+  unsigned opt_level;
+  std::string target;
+  // the objects tag() found, with their keys, until getObject() for their
+  // module. modules are tagged and compiled on several threads.
+  std::mutex mutex;
+  llvm::DenseMap<llvm::Module const *,
+                 std::pair<std::string, std::unique_ptr<llvm::MemoryBuffer>>>
+      found;
+
+  std::string key(llvm::Module const &module) const;
+  std::string path(std::string const &key) const;
+
+public:
+  DiskObjectCache(std::string directory, unsigned opt_level);
+
+  // make every compile of the jit built by builder go through this cache
+  void install(llvm::orc::LLJITBuilder &builder);
+
+  // record the cache key in the module. returns true if there's already an
+  // object for it, which compiling the module then returns.
+  bool tag(llvm::Module &module);
+
+  void notifyObjectCompiled(llvm::Module const *module,
+                            llvm::MemoryBufferRef object) override;
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(llvm::Module const *module) override;
+};
+
+#endif
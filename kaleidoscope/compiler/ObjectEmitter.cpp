@@ -0,0 +1,79 @@
+#include "ObjectEmitter.hpp"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+llvm::Expected<std::unique_ptr<llvm::TargetMachine>>
+create_host_target_machine(unsigned opt_level) {
+  auto jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!jtmb)
+    return jtmb.takeError();
+
+  static llvm::CodeGenOpt::Level const levels[] = {
+      llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+      llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+
+  jtmb->setRelocationModel(llvm::Reloc::PIC_);
+  jtmb->setCodeGenOptLevel(levels[opt_level > 3 ? 3 : opt_level]);
+  return jtmb->createTargetMachine();
+}
+
+static llvm::Error emit(llvm::Module &module, llvm::TargetMachine &tm,
+                        llvm::raw_pwrite_stream &out,
+                        llvm::CodeGenFileType type) {
+  module.setTargetTriple(tm.getTargetTriple().str());
+  module.setDataLayout(tm.createDataLayout());
+
+  llvm::legacy::PassManager pm;
+  if (tm.addPassesToEmitFile(pm, out, nullptr, type))
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   type == llvm::CGFT_ObjectFile
+                                       ? "target can't emit object files"
+                                       : "target can't emit assembly");
+  pm.run(module);
+  return llvm::Error::success();
+}
+
+llvm::Error emit_object(llvm::Module &module, llvm::TargetMachine &tm,
+                        llvm::StringRef path) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+  if (ec)
+    return llvm::createStringError(ec, "could not open %s",
+                                   path.str().c_str());
+
+  if (auto err = emit(module, tm, out, llvm::CGFT_ObjectFile))
+    return err;
+  out.close();
+
+  if (out.has_error())
+    return llvm::createStringError(out.error(), "could not write %s",
+                                   path.str().c_str());
+  return llvm::Error::success();
+}
+
+llvm::Error emit_assembly(llvm::Module &module, llvm::TargetMachine &tm,
+                          llvm::raw_pwrite_stream &out) {
+  return emit(module, tm, out, llvm::CGFT_AssemblyFile);
+}
+
+llvm::Error link_shared(llvm::StringRef object_path,
+                        llvm::StringRef library_path) {
+  auto driver = llvm::sys::findProgramByName("cc");
+  if (!driver)
+    return llvm::createStringError(driver.getError(),
+                                   "could not find a linker driver (cc)");
+
+  llvm::StringRef args[] = {*driver, "-shared", "-o", library_path,
+                            object_path};
+  std::string message;
+  if (llvm::sys::ExecuteAndWait(*driver, args, std::nullopt, {}, 0, 0,
+                                &message) != 0)
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "linking %s failed: %s",
+                                   library_path.str().c_str(),
+                                   message.c_str());
+  return llvm::Error::success();
+}
@@ -0,0 +1,30 @@
+#ifndef OBJECT_EMITTER_HPP
+#define OBJECT_EMITTER_HPP
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+
+// Ahead of time compilation of modules for the host.
+
+// a position independent target machine for the host cpu
+llvm::Expected<std::unique_ptr<llvm::TargetMachine>>
+create_host_target_machine(unsigned opt_level);
+
+// write module as a relocatable object file. the module's triple and data
+// layout are set to the target machine's.
+llvm::Error emit_object(llvm::Module &module, llvm::TargetMachine &tm,
+                        llvm::StringRef path);
+
+// write module as assembly to out, setting its triple and data layout the same
+llvm::Error emit_assembly(llvm::Module &module, llvm::TargetMachine &tm,
+                          llvm::raw_pwrite_stream &out);
+
+// link an object file into a shared library with the system compiler driver
+llvm::Error link_shared(llvm::StringRef object_path,
+                        llvm::StringRef library_path);
+
+#endif
@@ -0,0 +1,115 @@
+#include "Optimizer.hpp"
+#include "ObjectCache.hpp"
+#include "TimeReport.hpp"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <optional>
+
+Optimizer::Optimizer(unsigned level, DiskObjectCache *cache, Observer observer)
+    : level(level), cache(cache), observer(std::move(observer)) {}
+
+unsigned Optimizer::get_level() const { return level; }
+
+// for the cost models that decide whether vectorizing pays. target machines
+// aren't thread safe and modules are optimized on every compile thread, so
+// each run makes its own. nullptr if the host isn't supported.
+static std::unique_ptr<llvm::TargetMachine> host_target_machine() {
+  static std::optional<llvm::orc::JITTargetMachineBuilder> const host =
+      []() -> std::optional<llvm::orc::JITTargetMachineBuilder> {
+    auto host = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!host) {
+      llvm::consumeError(host.takeError());
+      return std::nullopt;
+    }
+    return std::move(*host);
+  }();
+  if (!host)
+    return nullptr;
+
+  auto builder = *host;
+  auto tm = builder.createTargetMachine();
+  if (!tm) {
+    llvm::consumeError(tm.takeError());
+    return nullptr;
+  }
+  return std::move(*tm);
+}
+
+void Optimizer::run(llvm::Module &module) const {
+  if (level == 0)
+    return;
+  TimeReport::Timer timer(TimeReport::Optimize);
+
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+
+  std::unique_ptr<llvm::TargetMachine> tm;
+  llvm::PipelineTuningOptions tuning;
+  if (level >= 2) {
+    tm = host_target_machine();
+    tuning.LoopVectorization = true;
+    tuning.SLPVectorization = true;
+  }
+
+  llvm::PassInstrumentationCallbacks callbacks;
+  auto report = TimeReport::active();
+  if (report)
+    report->instrument(callbacks);
+
+  llvm::PassBuilder pb(tm.get(), tuning, std::nullopt,
+                       report ? &callbacks : nullptr);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  llvm::FunctionPassManager fpm;
+  fpm.addPass(llvm::PromotePass());
+  // self recursion in tail position into loops
+  fpm.addPass(llvm::TailCallElimPass());
+  fpm.addPass(llvm::InstCombinePass());
+  fpm.addPass(llvm::ReassociatePass());
+  fpm.addPass(llvm::GVNPass());
+  fpm.addPass(llvm::SimplifyCFGPass());
+
+  llvm::ModulePassManager mpm;
+  mpm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+  if (level >= 2)
+    mpm.addPass(pb.buildPerModuleDefaultPipeline(
+        level == 2 ? llvm::OptimizationLevel::O2
+                   : llvm::OptimizationLevel::O3));
+
+  mpm.run(module, mam);
+}
+
+llvm::Expected<llvm::orc::ThreadSafeModule>
+Optimizer::operator()(llvm::orc::ThreadSafeModule module,
+                      llvm::orc::MaterializationResponsibility &) const {
+  module.withModuleDo([this](llvm::Module &m) {
+    if (cache && cache->tag(m))
+      return;
+    run(m);
+    if (observer)
+      observer(m);
+  });
+  TimeReport::compile_starts();
+  return std::move(module);
+}
+
+void Optimizer::install(llvm::orc::LLJIT &jit, unsigned level,
+                        DiskObjectCache *cache, Observer observer) {
+  jit.getIRTransformLayer().setTransform(
+      Optimizer(level, cache, std::move(observer)));
+}
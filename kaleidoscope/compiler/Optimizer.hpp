@@ -0,0 +1,48 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/Module.h"
+#include <functional>
+
+class DiskObjectCache;
+
+// Runs the new pass manager pipeline for an optimization level (0-3).
+//
+// 0 leaves the IR untouched, 1 runs the per-function cleanup passes, which
+// also turn self recursion in tail position into loops, and 2/3 additionally
+// run LLVM's default module pipeline for that level, with loop and SLP
+// vectorization for the host cpu's features.
+//
+// As a jit transform it tags modules for an object cache, and skips modules
+// whose object is already cached.
+class Optimizer {
+public:
+  // shown each module the transform has optimized, on the thread that did
+  using Observer = std::function<void(llvm::Module const &)>;
+
+private:
+  unsigned level;
+  DiskObjectCache *cache;
+  Observer observer;
+
+public:
+  Optimizer(unsigned level, DiskObjectCache *cache = nullptr,
+            Observer observer = {});
+
+  unsigned get_level() const;
+  void run(llvm::Module &module) const;
+
+  // transform for an IRTransformLayer
+  llvm::Expected<llvm::orc::ThreadSafeModule>
+  operator()(llvm::orc::ThreadSafeModule module,
+             llvm::orc::MaterializationResponsibility &responsibility) const;
+
+  // optimize every module added to the jit from now on
+  static void install(llvm::orc::LLJIT &jit, unsigned level,
+                      DiskObjectCache *cache = nullptr,
+                      Observer observer = {});
+};
+
+#endif
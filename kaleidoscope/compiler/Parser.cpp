@@ -1,31 +1,48 @@
 #include "Parser.hpp"
+#include "Optimizer.hpp"
 #include "kaleidoscope/compiler/Token.hpp"
 #include <llvm/ADT/APFloat.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iterator>
 #include <memory>
 using namespace std;
 
 namespace ast {
 
-Expr::~Expr() = default;
+NumberExpr::NumberExpr(double value) : Expr(KindNumber), value(value) {}
 
-NumberExpr::NumberExpr(double value) : value(value) {}
+double NumberExpr::get_value() const { return value; }
 
 llvm::Value *NumberExpr::codegen(CodegenContext &ctx) {
   return llvm::ConstantFP::get(*ctx.ctx, llvm::APFloat(value));
 }
 
-VariableExpr::VariableExpr(std::string name) : name(name) {}
+VariableExpr::VariableExpr(Symbol name) : Expr(KindVariable), name(name) {}
 
-BinaryExpr::BinaryExpr(std::string op, std::unique_ptr<Expr> lhs,
-                       std::unique_ptr<Expr> rhs)
-    : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+Symbol VariableExpr::get_name() const { return name; }
+
+BinaryExpr::BinaryExpr(BinaryOp op, Expr *lhs, Expr *rhs)
+    : Expr(KindBinary), op(op), lhs(lhs), rhs(rhs) {}
+
+BinaryOp BinaryExpr::get_op() const { return op; }
+
+Expr *BinaryExpr::get_lhs() const { return lhs; }
+
+Expr *BinaryExpr::get_rhs() const { return rhs; }
 
 llvm::Value *VariableExpr::codegen(CodegenContext &ctx) {
   auto e = ctx.named_values.find(name);
   if (e == ctx.named_values.end())
     throw CodegenException{};
+  if (auto variable = llvm::dyn_cast<llvm::AllocaInst>(e->second))
+    return ctx.builder->CreateLoad(variable->getAllocatedType(), variable,
+                                   name.str());
   return e->second;
 }
 
@@ -33,120 +50,294 @@ llvm::Value *BinaryExpr::codegen(CodegenContext &ctx) {
   auto lh = lhs->codegen(ctx);
   auto rh = rhs->codegen(ctx);
 
-  static auto const cg =
-      std::map<std::string,
-               std::function<llvm::Value *(CodegenContext & ctx, llvm::Value *,
-                                           llvm::Value *)>>{
-          {"+",
-           [](CodegenContext &ctx, llvm::Value *lh, llvm::Value *rh) {
-             return ctx.builder->CreateFAdd(lh, rh, "addtmp");
-           }},
-          {"-",
-           [](CodegenContext &ctx, llvm::Value *lh, llvm::Value *rh) {
-             return ctx.builder->CreateFSub(lh, rh, "addtmp");
-           }},
-          {"*",
-           [](CodegenContext &ctx, llvm::Value *lh, llvm::Value *rh) {
-             return ctx.builder->CreateFMul(lh, rh, "addtmp");
-           }},
-          {"<",
-           [](CodegenContext &ctx, llvm::Value *lh, llvm::Value *rh) {
-             lh = ctx.builder->CreateFCmpULT(lh, rh, "cmptmp");
-             // Convert bool 0/1 to double 0.0 or 1.0
-             return ctx.builder->CreateUIToFP(
-                 lh, llvm::Type::getDoubleTy(*ctx.ctx), "booltmp");
-           }},
-      };
-
-  if (auto e = cg.find(op); e != cg.end()) {
-    return e->second(ctx, lh, rh);
+  switch (op) {
+  case BinaryOp::Less:
+    lh = ctx.builder->CreateFCmpULT(lh, rh, "cmptmp");
+    // Convert bool 0/1 to double 0.0 or 1.0
+    return ctx.builder->CreateUIToFP(lh, llvm::Type::getDoubleTy(*ctx.ctx),
+                                     "booltmp");
+  case BinaryOp::Add:
+    return ctx.builder->CreateFAdd(lh, rh, "addtmp");
+  case BinaryOp::Subtract:
+    return ctx.builder->CreateFSub(lh, rh, "subtmp");
+  case BinaryOp::Multiply:
+    return ctx.builder->CreateFMul(lh, rh, "multmp");
   }
-  throw CodegenException{};
+  llvm_unreachable("unknown binary operator");
+}
+
+// len(xs) is the length of an array xs, rather than a call
+static Symbol const len_builtin = Symbol::intern("len");
+
+// externs for libm functions the backend knows as intrinsics, which calls are
+// generated as instead, so they can be folded, inlined and vectorized. a def
+// of the same name is called as usual.
+static struct {
+  Symbol name;
+  llvm::Intrinsic::ID id;
+  unsigned arity;
+} const intrinsics[] = {
+    {Symbol::intern("sin"), llvm::Intrinsic::sin, 1},
+    {Symbol::intern("cos"), llvm::Intrinsic::cos, 1},
+    {Symbol::intern("sqrt"), llvm::Intrinsic::sqrt, 1},
+    {Symbol::intern("exp"), llvm::Intrinsic::exp, 1},
+    {Symbol::intern("log"), llvm::Intrinsic::log, 1},
+    {Symbol::intern("fabs"), llvm::Intrinsic::fabs, 1},
+    {Symbol::intern("pow"), llvm::Intrinsic::pow, 2},
+};
+
+// the intrinsic a call to name with arguments stands for, if any
+static llvm::Intrinsic::ID get_intrinsic(CodegenContext const &ctx,
+                                         Symbol name,
+                                         llvm::ArrayRef<Expr *> arguments) {
+  auto e = ctx.signatures->find(name);
+  if (e == ctx.signatures->end() || e->second.defined || e->second.arrays)
+    return llvm::Intrinsic::not_intrinsic;
+  for (auto &intrinsic : intrinsics)
+    if (intrinsic.name == name && intrinsic.arity == arguments.size() &&
+        e->second.arity == arguments.size())
+      return intrinsic.id;
+  return llvm::Intrinsic::not_intrinsic;
+}
+
+// the array e names, if it's a variable naming one
+static CodegenContext::Array const *get_array(CodegenContext const &ctx,
+                                              Expr const *e) {
+  auto variable = llvm::dyn_cast<VariableExpr>(e);
+  return variable ? ctx.get_array(variable->get_name()) : nullptr;
 }
 
-CallExpr::CallExpr(std::string callee,
-                   std::vector<std::unique_ptr<Expr>> arguments)
-    : callee(std::move(callee)), arguments(std::move(arguments)) {}
+CallExpr::CallExpr(Symbol callee, llvm::ArrayRef<Expr *> arguments)
+    : Expr(KindCall), callee(callee), arguments(arguments) {}
+
+Symbol CallExpr::get_callee() const { return callee; }
+
+llvm::ArrayRef<Expr *> CallExpr::get_arguments() const { return arguments; }
+
+void CallExpr::set_tail() { tail = true; }
 
 llvm::Value *CallExpr::codegen(CodegenContext &ctx) {
-  // Look up the name in the global module table.
-  auto fn = ctx.get_proto(callee);
-  if (!fn)
-    throw CodegenException{};
+  if (callee == len_builtin && arguments.size() == 1)
+    if (auto array = get_array(ctx, arguments[0]))
+      return ctx.builder->CreateSIToFP(array->length,
+                                       ctx.builder->getDoubleTy(), "len");
+
+  if (auto id = get_intrinsic(ctx, callee, arguments)) {
+    std::vector<llvm::Value *> args;
+    for (auto &arg : arguments)
+      args.push_back(arg->codegen(ctx));
+    return ctx.builder->CreateIntrinsic(id, {ctx.builder->getDoubleTy()},
+                                        args, nullptr, "calltmp");
+  }
 
-  // If argument mismatch error.
-  if (fn->arg_size() != arguments.size())
+  auto fn = ctx.get_function(callee);
+  if (!fn)
     throw CodegenException{};
 
+  // arrays are passed where the callee takes a pointer
+  auto type = fn->getFunctionType();
   std::vector<llvm::Value *> args;
   for (auto &arg : arguments) {
-    args.push_back(arg->codegen(ctx));
+    if (args.size() == type->getNumParams())
+      throw CodegenException{};
+    if (!type->getParamType(args.size())->isPointerTy()) {
+      args.push_back(arg->codegen(ctx));
+      continue;
+    }
+    auto array = get_array(ctx, arg);
+    if (!array)
+      throw CodegenException{};
+    args.push_back(array->data);
+    args.push_back(array->length);
   }
+  if (args.size() != type->getNumParams())
+    throw CodegenException{};
+
+  auto call = ctx.builder->CreateCall(fn, args, "calltmp");
+  if (tail) {
+    auto caller = ctx.builder->GetInsertBlock()->getParent();
+    call->setTailCallKind(caller->getFunctionType() == type
+                              ? llvm::CallInst::TCK_MustTail
+                              : llvm::CallInst::TCK_Tail);
+  }
+  return call;
+}
 
-  return ctx.builder->CreateCall(fn, args, "calltmp");
+// where array[index] is
+static llvm::Value *get_element(CodegenContext &ctx, Symbol array,
+                                Expr *index) {
+  auto found = ctx.get_array(array);
+  if (!found)
+    throw CodegenException{};
+  auto &builder = *ctx.builder;
+  auto value = index->codegen(ctx);
+  auto i = ctx.whole_numbers.lookup(value);
+  if (!i)
+    i = builder.CreateFPToSI(value, builder.getInt64Ty());
+  return builder.CreateInBoundsGEP(builder.getDoubleTy(), found->data, i,
+                                   "element");
 }
 
-Prototype::Prototype(std::string name, std::vector<std::string> arguments)
-    : name(std::move(name)), arguments(std::move(arguments)) {}
+IndexExpr::IndexExpr(Symbol array, Expr *index)
+    : Expr(KindIndex), array(array), index(index) {}
 
-const std::string &Prototype::get_name() const { return name; }
+llvm::Value *IndexExpr::codegen(CodegenContext &ctx) {
+  return ctx.builder->CreateLoad(ctx.builder->getDoubleTy(),
+                                 get_element(ctx, array, index), "loadtmp");
+}
 
-llvm::Function *Prototype::codegen(CodegenContext &ctx) {
-  std::vector<llvm::Type *> parameters(arguments.size(),
-                                       llvm::Type::getDoubleTy(*ctx.ctx));
+StoreExpr::StoreExpr(Symbol array, Expr *index, Expr *value)
+    : Expr(KindStore), array(array), index(index), value(value) {}
+
+llvm::Value *StoreExpr::codegen(CodegenContext &ctx) {
+  auto element = get_element(ctx, array, index);
+  auto stored = value->codegen(ctx);
+  ctx.builder->CreateStore(stored, element);
+  return stored;
+}
+
+AssignExpr::AssignExpr(Symbol variable, Expr *value)
+    : Expr(KindAssign), variable(variable), value(value) {}
+
+llvm::Value *AssignExpr::codegen(CodegenContext &ctx) {
+  auto stored = value->codegen(ctx);
+  auto alloca =
+      llvm::dyn_cast_or_null<llvm::AllocaInst>(ctx.named_values.lookup(variable));
+  if (!alloca)
+    throw CodegenException{};
+  ctx.builder->CreateStore(stored, alloca);
+  return stored;
+}
+
+Prototype::Prototype(Symbol name, llvm::ArrayRef<Symbol> arguments,
+                     uint64_t arrays)
+    : Expr(KindPrototype), name(name), arguments(arguments), arrays(arrays) {}
 
-  auto func_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*ctx.ctx),
-                                           parameters, false);
+Symbol Prototype::get_name() const { return name; }
 
-  auto func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage,
-                                     name, ctx.module.get());
+void Prototype::set_name(Symbol name) { this->name = name; }
 
-  auto arg = arguments.begin();
-  for (auto &func_arg : func->args())
-    func_arg.setName(*arg++);
+llvm::ArrayRef<Symbol> Prototype::get_arguments() const { return arguments; }
 
+Signature Prototype::get_signature() const {
+  return {unsigned(arguments.size()), arrays};
+}
+
+// name func's arguments after prototype's, and an array's length
+// <name>.length. the body generated in ctx, if any, sees them by those names.
+static void bind_arguments(llvm::Function *func, Prototype const &prototype,
+                           CodegenContext *ctx) {
+  auto signature = prototype.get_signature();
+  auto arg = func->arg_begin();
+  for (unsigned i = 0; i < signature.arity; ++i) {
+    auto name = prototype.get_arguments()[i];
+    if (!signature.is_array(i)) {
+      arg->setName(name.str());
+      if (ctx)
+        ctx->named_values[name] = &*arg;
+      ++arg;
+      continue;
+    }
+    auto data = &*arg++;
+    auto length = &*arg++;
+    data->setName(name.str());
+    length->setName(name.str() + ".length");
+    if (ctx)
+      ctx->arrays[name] = {data, length};
+  }
+}
+
+llvm::Function *Prototype::codegen(CodegenContext &ctx) {
+  auto signature = get_signature();
+  auto func = ctx.declare(name, signature);
+  if (func->getFunctionType() != ctx.get_type(signature))
+    throw CodegenException{};
+
+  bind_arguments(func, *this, nullptr);
   return func;
 }
 
-Function::Function(std::unique_ptr<Prototype> prototype,
-                   std::unique_ptr<Expr> body)
-    : prototype(std::move(prototype)), body(std::move(body)) {}
+Function::Function(Prototype *prototype, Expr *body)
+    : Expr(KindFunction), prototype(prototype), body(body) {}
+
+Symbol Function::get_name() const { return prototype->get_name(); }
 
-std::string const &Function::get_name() const { return prototype->get_name(); }
+void Function::set_name(Symbol name) { prototype->set_name(name); }
+
+Prototype const &Function::get_prototype() const { return *prototype; }
+
+// mark the calls, ifs and vars whose value is e's, which is returned
+static void set_tail(Expr *e) {
+  if (auto call = llvm::dyn_cast<CallExpr>(e))
+    call->set_tail();
+  else if (auto if_expr = llvm::dyn_cast<If>(e))
+    if_expr->set_tail();
+  else if (auto var = llvm::dyn_cast<Var>(e))
+    var->set_tail();
+}
 
 llvm::Value *Function::codegen(CodegenContext &ctx) {
-  (*ctx.prototypes)[prototype->get_name()] = prototype;
-  auto func = ctx.get_proto(prototype->get_name());
-  if (!func)
-    func = prototype->codegen(ctx);
+  auto signature = prototype->get_signature();
+  signature.defined = true;
+  // recursive calls need the signature, but a body that fails leaves the
+  // table describing the function as it was
+  auto &signatures = *ctx.signatures;
+  auto known = signatures.find(get_name());
+  auto previous = known == signatures.end()
+                      ? std::nullopt
+                      : std::optional<Signature>(known->second);
+  auto restore = [&] {
+    if (previous)
+      signatures[get_name()] = *previous;
+    else
+      signatures.erase(get_name());
+  };
+  signatures[get_name()] = signature;
+  // the module may already declare it for an earlier call
+  auto func = ctx.get_function(get_name());
+  if (func->getFunctionType() != ctx.get_type(signature)) {
+    restore();
+    throw CodegenException{};
+  }
 
   auto *block = llvm::BasicBlock::Create(*ctx.ctx, "entry", func);
   ctx.builder->SetInsertPoint(block);
 
   // Record the function arguments in the NamedValues map.
   ctx.named_values.clear();
-  for (auto &arg : func->args())
-    ctx.named_values[std::string(arg.getName())] = &arg;
+  ctx.arrays.clear();
+  ctx.whole_numbers.clear();
+  bind_arguments(func, *prototype, &ctx);
 
+  set_tail(body);
   llvm::Value *ret;
   try {
     ret = body->codegen(ctx);
   } catch (CodegenException c) {
+    ctx.functions.erase(get_name());
     func->eraseFromParent();
+    restore();
     throw c;
   }
 
-  ctx.builder->CreateRet(ret);
+  // unless an if in tail position has returned already
+  if (!ctx.builder->GetInsertBlock()->getTerminator())
+    ctx.builder->CreateRet(ret);
 
   verifyFunction(*func);
 
   return func;
 }
 
-If::If(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> then_expr,
-       std::unique_ptr<Expr> else_expr)
-    : condition(std::move(condition)), then_expr(std::move(then_expr)),
-      else_expr(std::move(else_expr)) {};
+If::If(Expr *condition, Expr *then_expr, Expr *else_expr)
+    : Expr(KindIf), condition(condition), then_expr(then_expr),
+      else_expr(else_expr) {};
+
+void If::set_tail() {
+  tail = true;
+  ast::set_tail(then_expr);
+  ast::set_tail(else_expr);
+}
 
 llvm::Value *If::codegen(CodegenContext &ctx) {
   // the function containing the if statement
@@ -155,15 +346,28 @@ llvm::Value *If::codegen(CodegenContext &ctx) {
   auto then_block = llvm::BasicBlock::Create(*ctx.ctx, "then");
   auto else_block = llvm::BasicBlock::Create(*ctx.ctx, "else");
 
-  // the block both then and else will go to after completing
-  auto merge_block = llvm::BasicBlock::Create(*ctx.ctx, "ifcont");
-
   // generate code to choose whick block to go to
   auto cond = condition->codegen(ctx);
   auto cond_bool = ctx.builder->CreateFCmpONE(
       cond, llvm::ConstantFP::get(*ctx.ctx, llvm::APFloat(0.0)), "ifcond");
   ctx.builder->CreateCondBr(cond_bool, then_block, else_block);
 
+  if (tail) {
+    for (auto [block, expr] : {std::pair(then_block, then_expr),
+                               std::pair(else_block, else_expr)}) {
+      function->insert(function->end(), block);
+      ctx.builder->SetInsertPoint(block);
+      auto value = expr->codegen(ctx);
+      // unless it's an if in tail position too
+      if (!ctx.builder->GetInsertBlock()->getTerminator())
+        ctx.builder->CreateRet(value);
+    }
+    return nullptr;
+  }
+
+  // the block both then and else will go to after completing
+  auto merge_block = llvm::BasicBlock::Create(*ctx.ctx, "ifcont");
+
   // generate then block
   function->insert(function->end(), then_block);
   ctx.builder->SetInsertPoint(then_block);
@@ -190,13 +394,154 @@ llvm::Value *If::codegen(CodegenContext &ctx) {
   return phi;
 }
 
-For::For(const std::string &loop_var_name, std::unique_ptr<Expr> start,
-         std::unique_ptr<Expr> end, std::unique_ptr<Expr> step,
-         std::unique_ptr<Expr> body)
-    : loop_var_name(loop_var_name), start(std::move(start)),
-      end(::std::move(end)), step(std::move(step)), body(std::move(body)) {}
+For::For(Symbol loop_var_name, Expr *start, Expr *end, Expr *step, Expr *body)
+    : Expr(KindFor), loop_var_name(loop_var_name), start(start), end(end),
+      step(step), body(body) {}
+
+// whether e has the same value on every iteration of a loop over var. it can't
+// read var or a variable the body could assign, or call anything but len.
+static bool invariant(CodegenContext const &ctx, Expr const *e, Symbol var) {
+  if (llvm::isa<NumberExpr>(e))
+    return true;
+  if (auto variable = llvm::dyn_cast<VariableExpr>(e))
+    return variable->get_name() != var &&
+           !llvm::isa_and_nonnull<llvm::AllocaInst>(
+               ctx.named_values.lookup(variable->get_name()));
+  if (auto binary = llvm::dyn_cast<BinaryExpr>(e))
+    return invariant(ctx, binary->get_lhs(), var) &&
+           invariant(ctx, binary->get_rhs(), var);
+  if (auto call = llvm::dyn_cast<CallExpr>(e))
+    return call->get_callee() == len_builtin &&
+           call->get_arguments().size() == 1 &&
+           get_array(ctx, call->get_arguments()[0]);
+  return false;
+}
+
+Expr *For::get_bound(CodegenContext const &ctx, double &step_value) const {
+  step_value = 1;
+  if (step) {
+    auto number = llvm::dyn_cast<NumberExpr>(step);
+    if (!number)
+      return nullptr;
+    step_value = number->get_value();
+  }
+  // whole numbers add up exactly, so with a whole start and step, start + k *
+  // step is the value adding step k times would have given. a fractional
+  // start rounds differently on each addition.
+  auto whole = [](double value) {
+    return std::abs(value) <= 0x1p53 && value == std::floor(value);
+  };
+  auto start_number = llvm::dyn_cast<NumberExpr>(start);
+  if (!(step_value >= 1 && whole(step_value)) || !start_number ||
+      !whole(start_number->get_value()))
+    return nullptr;
+
+  auto condition = llvm::dyn_cast<BinaryExpr>(end);
+  if (!condition || condition->get_op() != BinaryOp::Less)
+    return nullptr;
+  auto variable = llvm::dyn_cast<VariableExpr>(condition->get_lhs());
+  if (!variable || variable->get_name() != loop_var_name ||
+      !invariant(ctx, condition->get_rhs(), loop_var_name))
+    return nullptr;
+  return condition->get_rhs();
+}
+
+void For::codegen_counted(CodegenContext &ctx, Expr *bound,
+                          double step_value) {
+  auto &builder = *ctx.builder;
+  auto function = builder.GetInsertBlock()->getParent();
+  auto double_type = builder.getDoubleTy();
+  auto index_type = builder.getInt64Ty();
+
+  auto start_val = start->codegen(ctx);
+  auto bound_val = bound->codegen(ctx);
+  auto step_val = llvm::ConstantFP::get(double_type, step_value);
+  auto at = [&](llvm::Value *index) {
+    auto offset = builder.CreateSIToFP(index, double_type);
+    if (step_value != 1)
+      offset = builder.CreateFMul(offset, step_val);
+    return builder.CreateFAdd(start_val, offset);
+  };
+  auto continues = [&](llvm::Value *index) {
+    return builder.CreateFCmpULT(at(index), bound_val);
+  };
+
+  // the body runs until the iteration whose value isn't less than the bound,
+  // which is about (bound - start) / step. a NaN bound never stops it, so that
+  // gets the largest count instead.
+  auto estimate = builder.CreateUnaryIntrinsic(
+      llvm::Intrinsic::ceil,
+      builder.CreateFDiv(builder.CreateFSub(bound_val, start_val), step_val));
+  estimate = builder.CreateMaxNum(
+      builder.CreateMinNum(estimate,
+                           llvm::ConstantFP::get(double_type, 0x1p62)),
+      llvm::ConstantFP::get(double_type, 0));
+  llvm::Value *last = builder.CreateFPToSI(estimate, index_type, "estimate");
+
+  // the division can round either way, so check against the comparisons the
+  // loop would have made
+  auto one = builder.getInt64(1);
+  auto before = builder.CreateSub(last, one);
+  last = builder.CreateSelect(
+      builder.CreateAnd(builder.CreateICmpSGT(last, builder.getInt64(0)),
+                        builder.CreateNot(continues(before))),
+      before, last);
+  last = builder.CreateSelect(continues(last), builder.CreateAdd(last, one),
+                              last, "last");
+
+  auto entry = builder.GetInsertBlock();
+  auto loop = llvm::BasicBlock::Create(*ctx.ctx, "loop");
+  auto after_loop = llvm::BasicBlock::Create(*ctx.ctx, "afterloop");
+  builder.CreateBr(loop);
+
+  function->insert(function->end(), loop);
+  builder.SetInsertPoint(loop);
+  auto index = builder.CreatePHI(index_type, 2, "index");
+  index->addIncoming(builder.getInt64(0), entry);
+  auto loop_var = at(index);
+  loop_var->setName(loop_var_name.str());
+  // get_bound only takes a whole start. index * step stays below bound -
+  // start + step, so it can't wrap when the bound is an array's length or a
+  // constant no larger than 2^53, like the start and step. other bounds only
+  // cap the count at 2^62, which times a large step can wrap.
+  auto start_number = llvm::cast<NumberExpr>(start);
+  auto bound_number = llvm::dyn_cast<NumberExpr>(bound);
+  auto bound_call = llvm::dyn_cast<CallExpr>(bound);
+  bool bounded =
+      (bound_number && std::abs(bound_number->get_value()) <= 0x1p53) ||
+      (bound_call && bound_call->get_callee() == len_builtin);
+  ctx.whole_numbers[loop_var] = builder.CreateAdd(
+      builder.CreateMul(index, builder.getInt64(int64_t(step_value)), "",
+                        bounded, bounded),
+      builder.getInt64(int64_t(start_number->get_value())), "", false,
+      bounded);
+
+  llvm::Value *shadow = loop_var;
+  std::swap(shadow, ctx.named_values[loop_var_name]);
+
+  body->codegen(ctx);
+
+  auto next_index = builder.CreateAdd(index, one, "nextindex", true, true);
+  builder.CreateCondBr(builder.CreateICmpNE(index, last, "loopcond"), loop,
+                       after_loop);
+  index->addIncoming(next_index, builder.GetInsertBlock());
+
+  function->insert(function->end(), after_loop);
+  builder.SetInsertPoint(after_loop);
+
+  if (shadow)
+    ctx.named_values[loop_var_name] = shadow;
+  else
+    ctx.named_values.erase(loop_var_name);
+}
 
 llvm::Value *For::codegen(CodegenContext &ctx) {
+  double step_constant;
+  if (auto bound = get_bound(ctx, step_constant)) {
+    codegen_counted(ctx, bound, step_constant);
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*ctx.ctx));
+  }
+
   auto function = ctx.builder->GetInsertBlock()->getParent();
 
   auto loop = llvm::BasicBlock::Create(*ctx.ctx, "loop");
@@ -251,6 +596,41 @@ llvm::Value *For::codegen(CodegenContext &ctx) {
   return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*ctx.ctx));
 }
 
+Var::Var(llvm::ArrayRef<Binding> bindings, Expr *body)
+    : Expr(KindVar), bindings(bindings), body(body) {}
+
+void Var::set_tail() { ast::set_tail(body); }
+
+llvm::Value *Var::codegen(CodegenContext &ctx) {
+  auto &builder = *ctx.builder;
+  auto &entry = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  llvm::IRBuilder<> allocas(&entry, entry.begin());
+
+  // what each binding shadows, to restore once the body's done
+  llvm::SmallVector<llvm::Value *, 4> shadowed;
+  for (auto &binding : bindings) {
+    // before the variable is bound, so var x = x reads the outer x
+    auto value = binding.initializer
+                     ? binding.initializer->codegen(ctx)
+                     : llvm::ConstantFP::get(builder.getDoubleTy(), 0.0);
+    auto variable = allocas.CreateAlloca(builder.getDoubleTy(), nullptr,
+                                         binding.name.str());
+    builder.CreateStore(value, variable);
+    shadowed.push_back(variable);
+    std::swap(shadowed.back(), ctx.named_values[binding.name]);
+  }
+
+  auto value = body->codegen(ctx);
+
+  for (size_t i = bindings.size(); i-- > 0;) {
+    if (shadowed[i])
+      ctx.named_values[bindings[i].name] = shadowed[i];
+    else
+      ctx.named_values.erase(bindings[i].name);
+  }
+  return value;
+}
+
 } // namespace ast
 
 bool Parser::peeking() { return _peeking; }
@@ -259,10 +639,34 @@ Token const &Parser::peek() {
   if (_peeking)
     return current;
   _peeking = true;
-  *stream >> current;
+  ++tokens;
+  if (lexer) {
+    auto token = lexer->next();
+    current = token.to_token();
+    current_offset = token.offset;
+    current_location = token.location;
+  } else {
+    *stream >> current;
+  }
   return current;
 }
 
+size_t Parser::peek_offset() {
+  peek();
+  return current_offset;
+}
+
+SourceLocation Parser::peek_location() {
+  peek();
+  return current_location;
+}
+
+size_t Parser::get_statement_offset() const { return statement_offset; }
+
+size_t Parser::get_token_count() const { return tokens; }
+
+void Parser::reset() { _peeking = false; }
+
 Token const &Parser::next() {
   peek();
   _peeking = false;
@@ -270,36 +674,60 @@ Token const &Parser::next() {
 }
 
 // <NumberExpr> ::= <number>
-std::unique_ptr<ast::NumberExpr> Parser::parse_number() {
-  return std::make_unique<ast::NumberExpr>(next().number);
+ast::NumberExpr *Parser::parse_number() {
+  return arena->make<ast::NumberExpr>(next().number);
 }
 
-std::unique_ptr<ast::Expr> Parser::parse_parenthesized() {
+ast::Expr *Parser::parse_parenthesized() {
   next();
 
   auto expr = parse_expression();
   if (!expr)
     throw ParseError{};
 
-  if (next().type != Token::TypeRpar)
+  if (peek().type != Token::TypeRpar)
     throw ParseError{};
+  next();
 
   return expr;
 }
 
-// either a variable or a call
-std ::unique_ptr<ast::Expr> Parser::parse_identifier() {
-  std::string identifier = next().literal;
+ast::Expr *Parser::parse_identifier() {
+  static auto const assign = Symbol::intern("=");
+  auto identifier = next().symbol;
+
+  if (peek().type == Token::TypeLbracket) {
+    next();
+    auto index = parse_expression();
+    if (!index || peek().type != Token::TypeRbracket)
+      throw ParseError{};
+    next();
+    if (peek().type != Token::TypeOperator || peek().symbol != assign)
+      return arena->make<ast::IndexExpr>(identifier, index);
+    next();
+    auto value = parse_expression();
+    if (!value)
+      throw ParseError{};
+    return arena->make<ast::StoreExpr>(identifier, index, value);
+  }
+
+  if (peek().type == Token::TypeOperator && peek().symbol == assign) {
+    next();
+    auto value = parse_expression();
+    if (!value)
+      throw ParseError{};
+    return arena->make<ast::AssignExpr>(identifier, value);
+  }
 
   if (peek().type != Token::TypeLpar)
-    return std::make_unique<ast::VariableExpr>(identifier);
+    return arena->make<ast::VariableExpr>(identifier);
   next();
 
-  std::vector<std::unique_ptr<ast::Expr>> args;
+  llvm::SmallVector<ast::Expr *, 4> args;
   if (peek().type != Token::TypeRpar) {
     for (;;) {
       if (auto expr = parse_expression()) {
-        args.push_back(std::move(expr));
+        args.push_back(expr);
       } else {
         throw ParseError{};
       }
@@ -314,11 +742,11 @@ std ::unique_ptr<ast::Expr> Parser::parse_identifier() {
   }
   next();
 
-  return std::make_unique<ast::CallExpr>(std::move(identifier),
-                                         std::move(args));
+  auto arguments = arena->copy(llvm::ArrayRef<ast::Expr *>(args));
+  return arena->make<ast::CallExpr>(identifier, arguments);
 }
 
-std ::unique_ptr<ast::If> Parser::parse_if() {
+ast::If *Parser::parse_if() {
   assert(peek().type == Token::TypeIf);
   next();
 
@@ -339,18 +767,17 @@ std ::unique_ptr<ast::If> Parser::parse_if() {
   auto else_expr = parse_expression();
   assert(else_expr);
 
-  return std::make_unique<ast::If>(std::move(cond), std::move(then),
-                                   std::move(else_expr));
+  return arena->make<ast::If>(cond, then, else_expr);
 }
 
-std::unique_ptr<ast::For> Parser::parse_for() {
+ast::For *Parser::parse_for() {
   assert(peek().type == Token::TypeFor);
   next();
 
   if (peek().type != Token::TypeIdentifier)
     throw ParseError{};
 
-  auto loop_var = next().literal;
+  auto loop_var = next().symbol;
 
   if (!(peek().type == Token::TypeOperator && peek().literal == "="))
     throw ParseError{};
@@ -365,7 +792,7 @@ std::unique_ptr<ast::For> Parser::parse_for() {
   auto end = parse_expression();
   assert(end);
 
-  std::unique_ptr<ast::Expr> step;
+  ast::Expr *step = nullptr;
   if (peek().type == Token::TypeComma) {
     next();
 
@@ -380,11 +807,42 @@ std::unique_ptr<ast::For> Parser::parse_for() {
   auto body = parse_expression();
   assert(body);
 
-  return std::make_unique<ast::For>(loop_var, std::move(start), std::move(end),
-                                    std::move(step), std::move(body));
+  return arena->make<ast::For>(loop_var, start, end, step, body);
 }
 
-std ::unique_ptr<ast::Expr> Parser::parse_primary() {
+ast::Var *Parser::parse_var() {
+  static auto const assign = Symbol::intern("=");
+  assert(peek().type == Token::TypeVar);
+  next();
+
+  llvm::SmallVector<ast::Var::Binding, 4> bindings;
+  for (;;) {
+    if (peek().type != Token::TypeIdentifier)
+      throw ParseError{};
+    auto name = next().symbol;
+
+    ast::Expr *initializer = nullptr;
+    if (peek().type == Token::TypeOperator && peek().symbol == assign) {
+      next();
+      initializer = parse_expression();
+    }
+    bindings.push_back({name, initializer});
+
+    if (peek().type != Token::TypeComma)
+      break;
+    next();
+  }
+
+  if (peek().type != Token::TypeIn)
+    throw ParseError{};
+  next();
+
+  auto body = parse_expression();
+  return arena->make<ast::Var>(
+      arena->copy(llvm::ArrayRef<ast::Var::Binding>(bindings)), body);
+}
+
+ast::Expr *Parser::parse_primary() {
   switch (peek().type) {
   default:
     throw ParseError{};
@@ -398,93 +856,141 @@ std ::unique_ptr<ast::Expr> Parser::parse_primary() {
     return parse_if();
   case Token::TypeFor:
     return parse_for();
+  case Token::TypeVar:
+    return parse_var();
   }
 }
 
-int Parser::get_token_precedence(std::string const &token) {
-  if (auto e = binary_precedence.find(token); e != binary_precedence.end()) {
-    return e->second;
-  }
-  return -1;
+std::optional<ast::BinaryOp> Parser::get_binary_op(Token const &token) {
+  if (token.type != Token::TypeOperator)
+    return std::nullopt;
+
+  static auto const spellings = [] {
+    std::array<Symbol, std::size(ast::binary_ops)> symbols;
+    for (size_t i = 0; i < symbols.size(); ++i)
+      symbols[i] = Symbol::intern(ast::binary_ops[i].spelling);
+    return symbols;
+  }();
+
+  for (size_t i = 0; i < spellings.size(); ++i)
+    if (spellings[i] == token.symbol)
+      return static_cast<ast::BinaryOp>(i);
+  return std::nullopt;
 }
 
-std::unique_ptr<ast::Expr> Parser::parse_expression() {
+int Parser::get_token_precedence(Token const &token) {
+  auto op = get_binary_op(token);
+  return op ? ast::info(*op).precedence : -1;
+}
+
+ast::Expr *Parser::parse_expression() {
   auto lhs = parse_primary();
 
-  return parse_binary_rhs(0, std::move(lhs));
+  return parse_binary_rhs(0, lhs);
 }
 
-std::unique_ptr<ast::Expr>
-Parser::parse_binary_rhs(int lhs_prec, std::unique_ptr<ast::Expr> lhs) {
+ast::Expr *Parser::parse_binary_rhs(int lhs_prec, ast::Expr *lhs) {
   for (;;) {
-    int op_prec = get_token_precedence(peek().literal);
+    auto op = get_binary_op(peek());
+    int op_prec = op ? ast::info(*op).precedence : -1;
     if (op_prec < lhs_prec)
       return lhs;
 
-    auto op = next().literal;
+    next();
 
     auto rhs = parse_primary();
 
-    int next_prec = get_token_precedence(peek().literal);
+    int next_prec = get_token_precedence(peek());
     if (op_prec < next_prec) {
-      rhs = parse_binary_rhs(op_prec + 1, std::move(rhs));
+      rhs = parse_binary_rhs(op_prec + 1, rhs);
     }
 
-    lhs = std::make_unique<ast::BinaryExpr>(op, std::move(lhs), std::move(rhs));
+    lhs = arena->make<ast::BinaryExpr>(*op, lhs, rhs);
   }
 }
 
-std::unique_ptr<ast::Prototype> Parser::parse_prototype() {
+ast::Prototype *Parser::parse_prototype() {
   if (peek().type != Token::TypeIdentifier)
     throw ParseError{};
 
-  std::string name = next().literal;
+  auto name = next().symbol;
 
   if (peek().type != Token::TypeLpar)
     throw ParseError{};
   next();
 
-  std::vector<std::string> args;
-  while (peek().type == Token::TypeIdentifier)
-    args.push_back(next().literal);
+  // xs[] is an array
+  std::vector<Symbol> args;
+  uint64_t arrays = 0;
+  while (peek().type == Token::TypeIdentifier) {
+    args.push_back(next().symbol);
+    if (peek().type != Token::TypeLbracket)
+      continue;
+    next();
+    if (peek().type != Token::TypeRbracket ||
+        args.size() > Signature::max_arrays)
+      throw ParseError{};
+    next();
+    arrays |= uint64_t(1) << (args.size() - 1);
+  }
 
   if (peek().type != Token::TypeRpar)
     throw ParseError{};
   next();
 
-  return std::make_unique<ast::Prototype>(std::move(name), std::move(args));
+  return arena->make<ast::Prototype>(
+      name, arena->copy(llvm::ArrayRef<Symbol>(args)), arrays);
 }
 
-std::unique_ptr<ast::Function> Parser::parse_definition() {
+ast::Function *Parser::parse_definition() {
   next();
-  return std::make_unique<ast::Function>(parse_prototype(), parse_expression());
+  // the prototype has to be parsed before the body
+  auto prototype = parse_prototype();
+  return arena->make<ast::Function>(prototype, parse_expression());
 }
 
-std::unique_ptr<ast::Prototype> Parser::parse_extern() {
+ast::Prototype *Parser::parse_extern() {
   next();
   return parse_prototype();
 }
 
-std::unique_ptr<ast::Function> Parser::parse_top_level() {
-  return std::make_unique<ast::Function>(
-      std::make_unique<ast::Prototype>("__anon_expr",
-                                       std::vector<std::string>{}),
+ast::Function *Parser::parse_top_level() {
+  static auto const anon_expr = Symbol::intern("__anon_expr");
+  return arena->make<ast::Function>(
+      arena->make<ast::Prototype>(anon_expr, llvm::ArrayRef<Symbol>()),
       parse_expression());
 }
 
 char const *Parser::ParseError::what() const noexcept { return "parser error"; }
 
 Parser::Parser()
-    : binary_precedence{{"<", 10}, {"+", 20}, {"-", 20}, {"*", 40}},
-      _peeking(false) {}
+    : current_offset(0), current_location(), statement_offset(0), tokens(0),
+      _peeking(false),
+      stream(nullptr), lexer(nullptr), arena(nullptr) {}
 
-std::unique_ptr<ast::Expr> Parser::parse(std::istream &s) {
+ast::Expr *Parser::parse(std::istream &s, ast::Arena &a) {
   stream = &s;
+  lexer = nullptr;
+  arena = &a;
+  return parse_statement();
+}
+
+ast::Expr *Parser::parse(Lexer &l, ast::Arena &a) {
+  stream = nullptr;
+  lexer = &l;
+  arena = &a;
+  return parse_statement();
+}
+
+ast::Expr *Parser::parse_statement() {
   while (peek().type == Token::TypeSemicolon) {
     next();
   }
+  statement_offset = current_offset;
 
   switch (peek().type) {
+  case Token::TypeEOF:
+    return nullptr;
   case Token::TypeDef:
     return parse_definition();
   case Token::TypeExtern:
@@ -494,12 +1000,95 @@ std::unique_ptr<ast::Expr> Parser::parse(std::istream &s) {
   }
 }
 
-llvm::Function *CodegenContext::get_proto(std::string name) {
-  if (auto *func = module->getFunction(name))
+void Parser::synchronize() {
+  for (;;) {
+    switch (peek().type) {
+    case Token::TypeSemicolon:
+      next();
+      return;
+    case Token::TypeDef:
+    case Token::TypeExtern:
+    case Token::TypeEOF:
+      return;
+    default:
+      next();
+    }
+  }
+}
+
+void Parser::diagnose(std::ostream &errors, ParseError const &e) {
+  assert(lexer);
+  auto source = lexer->get_source();
+  auto location = peek_location();
+  auto offset = current_offset;
+
+  auto line_start = [&](size_t offset) -> size_t {
+    auto newline = offset ? source.rfind('\n', offset - 1) : source.npos;
+    return newline == source.npos ? 0 : newline + 1;
+  };
+  auto start = line_start(std::min(statement_offset, offset));
+  auto line_end = std::min(source.find('\n', offset), source.size());
+
+  errors << location.line << ':' << location.column << ": " << e.what()
+         << '\n';
+  errors << source.substr(start, line_end - start) << '\n';
+  errors << std::string(location.column - 1, ' ') << "^ Unexpected "
+         << current << "\n";
+}
+
+llvm::Function *CodegenContext::get_function(Symbol name) {
+  if (auto func = functions.lookup(name))
     return func;
 
-  if (auto e = prototypes->find(name); e != prototypes->end())
-    return e->second.get()->codegen(*this);
+  auto e = signatures->find(name);
+  if (e == signatures->end())
+    return nullptr;
+  return declare(name, e->second);
+}
 
-  return nullptr;
+llvm::Function *CodegenContext::declare(Symbol name, Signature signature) {
+  // an extern doesn't take a def's body away
+  auto &known = (*signatures)[name];
+  signature.defined |= known.defined;
+  known = signature;
+  auto &func = functions[name];
+  if (func)
+    return func;
+
+  func = llvm::Function::Create(get_type(signature),
+                                llvm::Function::ExternalLinkage, name.str(),
+                                module.get());
+  return func;
 }
+
+llvm::FunctionType *CodegenContext::get_type(Signature signature) {
+  auto number = llvm::Type::getDoubleTy(*ctx);
+  std::vector<llvm::Type *> parameters;
+  for (unsigned i = 0; i < signature.arity; ++i) {
+    if (!signature.is_array(i)) {
+      parameters.push_back(number);
+      continue;
+    }
+    parameters.push_back(llvm::PointerType::getUnqual(number));
+    parameters.push_back(llvm::Type::getInt64Ty(*ctx));
+  }
+  return llvm::FunctionType::get(number, parameters, false);
+}
+
+CodegenContext::Array const *CodegenContext::get_array(Symbol name) const {
+  if (named_values.count(name))
+    return nullptr;
+  auto e = arrays.find(name);
+  return e == arrays.end() ? nullptr : &e->second;
+}
+
+llvm::orc::ThreadSafeModule CodegenContext::take_module() {
+  builder.reset();
+  named_values.clear();
+  functions.clear();
+  llvm::orc::ThreadSafeModule taken(std::move(module), ts_ctx);
+  lock.reset();
+  return taken;
+}
+
+void CodegenContext::optimize(unsigned level) { Optimizer(level).run(*module); }
@@ -1,8 +1,13 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
+#include "Arena.hpp"
+#include "Lexer.hpp"
+#include "Symbol.hpp"
 #include "Token.hpp"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
@@ -10,44 +15,176 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/raw_ostream.h"
 #include <map>
 #include <memory>
+#include <optional>
 #include <vector>
 
 struct CodegenException : std::exception {
   char const *what() const noexcept override { return "codegen error"; }
 };
 
+namespace bytecode {
+class Writer;
+}
+
 namespace ast {
 class Prototype;
+
+enum class BinaryOp { Less, Add, Subtract, Multiply };
+
+struct BinaryOpInfo {
+  char const *spelling;
+  int precedence;
+};
+
+// indexed by BinaryOp; the parser's precedence and codegen both use this
+constexpr BinaryOpInfo binary_ops[] = {
+    {"<", 10},
+    {"+", 20},
+    {"-", 20},
+    {"*", 40},
+};
+
+constexpr BinaryOpInfo const &info(BinaryOp op) {
+  return binary_ops[static_cast<size_t>(op)];
 }
+} // namespace ast
 
+// what a call needs to know about a function: how many arguments it takes,
+// and which of them are arrays rather than doubles. it returns a double.
+//
+// an array is passed as a pointer to its first double and an i64 length, so
+// def f(xs[] y) is a double (*)(double *, int64_t, double).
+struct Signature {
+  unsigned arity;
+  // bit i for argument i
+  uint64_t arrays;
+  // whether a def has given it a body, as opposed to only an extern. not part
+  // of the type.
+  bool defined = false;
+
+  static constexpr unsigned max_arrays = 64;
+
+  bool is_array(unsigned argument) const {
+    return argument < max_arrays && (arrays >> argument & 1);
+  }
+  bool operator==(Signature that) const {
+    return arity == that.arity && arrays == that.arrays;
+  }
+  bool operator!=(Signature that) const { return !(*this == that); }
+};
+
+// every function defined or declared so far, so later modules can declare them
+using SignatureTable = llvm::DenseMap<Symbol, Signature>;
+
+// Where a statement is generated. The context may be shared with modules being
+// compiled on other threads, so its lock is held until take_module().
 struct CodegenContext {
-  std::unique_ptr<llvm::LLVMContext> ctx;
+  // an array argument
+  struct Array {
+    llvm::Value *data, *length;
+  };
+
+  llvm::orc::ThreadSafeContext ts_ctx;
+  std::optional<llvm::orc::ThreadSafeContext::Lock> lock;
+  llvm::LLVMContext *ctx;
   std::unique_ptr<llvm::Module> module;
   std::unique_ptr<llvm::IRBuilder<>> builder;
-  std::map<std::string, llvm::Value *> named_values;
-  std::map<std::string, std::shared_ptr<ast::Prototype>> *prototypes;
-
-  CodegenContext(
-      llvm::orc::LLJIT *jit,
-      std::map<std::string, std::shared_ptr<ast::Prototype>> *prototypes)
-      : prototypes(prototypes) {
-    ctx = std::make_unique<llvm::LLVMContext>();
+  // the values of arguments and loop variables, and the allocas of variables
+  // bound by var
+  llvm::DenseMap<Symbol, llvm::Value *> named_values;
+  // unless a named value shadows them
+  llvm::DenseMap<Symbol, Array> arrays;
+  // doubles known to hold whole numbers, like counted loop variables, and
+  // i64s holding the same value, for indexing without a conversion the loop
+  // passes can't see through
+  llvm::DenseMap<llvm::Value *, llvm::Value *> whole_numbers;
+  SignatureTable *signatures;
+  // what the module has declared or defined so far. whatever renames or
+  // erases one of them has to drop it from here too.
+  llvm::DenseMap<Symbol, llvm::Function *> functions;
+
+  CodegenContext(llvm::DataLayout const &data_layout,
+                 SignatureTable *signatures,
+                 llvm::orc::ThreadSafeContext context = fresh_context())
+      : ts_ctx(std::move(context)), lock(ts_ctx.getLock()),
+        ctx(ts_ctx.getContext()), signatures(signatures) {
     module = std::make_unique<llvm::Module>("my jit", *ctx);
     builder = std::make_unique<llvm::IRBuilder<>>(*ctx);
-    module->setDataLayout(jit->getDataLayout());
-    // todo: add the optimization passes
+    module->setDataLayout(data_layout);
+  }
+
+  CodegenContext(llvm::orc::LLJIT *jit, SignatureTable *signatures,
+                 llvm::orc::ThreadSafeContext context = fresh_context())
+      : CodegenContext(jit->getDataLayout(), signatures, std::move(context)) {}
+
+  static llvm::orc::ThreadSafeContext fresh_context() {
+    return llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
   }
 
-  llvm::Function *get_proto(std::string name);
+  // hand the module over to be compiled, unlocking the context. nothing else
+  // can be generated afterwards.
+  llvm::orc::ThreadSafeModule take_module();
+
+  // the module's function name, declaring it the first time it's needed.
+  // nullptr if it isn't in signatures either.
+  llvm::Function *get_function(Symbol name);
+  // record name's signature for this module and later ones, and declare it
+  llvm::Function *declare(Symbol name, Signature signature);
+  llvm::FunctionType *get_type(Signature signature);
+  // the array called name, or nullptr
+  Array const *get_array(Symbol name) const;
+
+  // run the optimization pipeline for level (0-3) over the module. modules
+  // handed to a jit with an Optimizer installed don't need this.
+  void optimize(unsigned level);
 };
 
+// Syntax tree nodes are allocated from an Arena and refer to each other with
+// plain pointers; names are interned Symbols. Use llvm::isa/dyn_cast to tell
+// nodes apart.
 namespace ast {
 class Expr {
 public:
-  virtual ~Expr();
+  enum Kind {
+    KindNumber,
+    KindVariable,
+    KindBinary,
+    KindCall,
+    KindIndex,
+    KindStore,
+    KindAssign,
+    KindPrototype,
+    KindFunction,
+    KindIf,
+    KindFor,
+    KindVar,
+  };
+
+private:
+  Kind kind;
+
+protected:
+  Expr(Kind kind) : kind(kind) {}
+
+public:
+  Kind get_kind() const { return kind; }
   virtual llvm::Value *codegen(CodegenContext &ctx) = 0;
+  // as source, with every binary operation parenthesized. definitions and
+  // externs start with def or extern; top level expressions are printed bare.
+  virtual void print(llvm::raw_ostream &out) const = 0;
+  // what to generate in place of this, with constant arithmetic folded,
+  // operations that leave their operand as it is dropped, and ifs with a
+  // constant condition replaced by their branch. the children are simplified
+  // in place, and new nodes are allocated from arena.
+  virtual Expr *simplify(Arena &arena) = 0;
+  // lower into the function out is writing, as code that leaves the value on
+  // the stack. a function's body is followed by a return; prototypes are
+  // added by the writer itself.
+  virtual void emit(bytecode::Writer &out) const = 0;
 };
 
 class NumberExpr : public Expr {
@@ -55,81 +192,234 @@ class NumberExpr : public Expr {
 
 public:
   NumberExpr(double value);
+  double get_value() const;
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindNumber; }
 };
 
 class VariableExpr : public Expr {
-  std::string name;
+  Symbol name;
 
 public:
-  VariableExpr(std::string name);
+  VariableExpr(Symbol name);
+  Symbol get_name() const;
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindVariable; }
 };
 
 class BinaryExpr : public Expr {
-  std::string op;
-  std::unique_ptr<Expr> lhs, rhs;
+  BinaryOp op;
+  Expr *lhs, *rhs;
 
 public:
-  BinaryExpr(std::string op, std::unique_ptr<Expr> lhs,
-             std::unique_ptr<Expr> rhs);
+  BinaryExpr(BinaryOp op, Expr *lhs, Expr *rhs);
 
+  BinaryOp get_op() const;
+  Expr *get_lhs() const;
+  Expr *get_rhs() const;
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindBinary; }
 };
 
+// A call in tail position is marked tail, or musttail when the callee has the
+// caller's type, as self recursion does, so it reuses the caller's frame even
+// without optimization.
 class CallExpr : public Expr {
-  std::string callee;
-  std::vector<std::unique_ptr<Expr>> arguments;
+  Symbol callee;
+  llvm::ArrayRef<Expr *> arguments;
+  bool tail = false;
 
 public:
-  CallExpr(std::string callee, std::vector<std::unique_ptr<Expr>> arguments);
+  CallExpr(Symbol callee, llvm::ArrayRef<Expr *> arguments);
 
+  Symbol get_callee() const;
+  llvm::ArrayRef<Expr *> get_arguments() const;
+  // its value is what the function returns
+  void set_tail();
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindCall; }
+};
+
+// array[index], with the index rounded toward zero. like the store, it isn't
+// checked against the array's length.
+class IndexExpr : public Expr {
+  Symbol array;
+  Expr *index;
+
+public:
+  IndexExpr(Symbol array, Expr *index);
+
+  llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindIndex; }
+};
+
+// array[index] = value, which is also what it evaluates to
+class StoreExpr : public Expr {
+  Symbol array;
+  Expr *index, *value;
+
+public:
+  StoreExpr(Symbol array, Expr *index, Expr *value);
+
+  llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindStore; }
+};
+
+// variable = value, which is also what it evaluates to. only variables bound
+// by var can be assigned; arguments and loop variables can't.
+class AssignExpr : public Expr {
+  Symbol variable;
+  Expr *value;
+
+public:
+  AssignExpr(Symbol variable, Expr *value);
+
+  llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindAssign; }
 };
 
 class Prototype : public Expr {
-  std::string name;
-  std::vector<std::string> arguments;
+  Symbol name;
+  llvm::ArrayRef<Symbol> arguments;
+  // as in Signature
+  uint64_t arrays;
 
 public:
-  Prototype(std::string name, std::vector<std::string> arguments);
+  Prototype(Symbol name, llvm::ArrayRef<Symbol> arguments,
+            uint64_t arrays = 0);
 
-  const std::string &get_name() const;
+  Symbol get_name() const;
+  void set_name(Symbol name);
+  llvm::ArrayRef<Symbol> get_arguments() const;
+  Signature get_signature() const;
   llvm::Function *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindPrototype; }
 };
 
 class Function : public Expr {
-  std::shared_ptr<Prototype> prototype;
-  std::unique_ptr<Expr> body;
+  Prototype *prototype;
+  Expr *body;
 
 public:
-  Function(std::unique_ptr<Prototype> prototype, std::unique_ptr<Expr> body);
+  Function(Prototype *prototype, Expr *body);
 
-  std::string const &get_name() const;
+  Symbol get_name() const;
+  void set_name(Symbol name);
+  Prototype const &get_prototype() const;
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindFunction; }
 };
 
+// In tail position, each branch returns its value itself rather than merging
+// into a phi, so the calls in tail position in either are followed by a ret.
+// codegen() then leaves the block terminated, and the if has no value.
 class If : public Expr {
-  std::unique_ptr<Expr> condition;
-  std::unique_ptr<Expr> then_expr;
-  std::unique_ptr<Expr> else_expr;
+  Expr *condition;
+  Expr *then_expr;
+  Expr *else_expr;
+  bool tail = false;
 
 public:
-  If(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> then_expr,
-     std::unique_ptr<Expr> else_expr);
+  If(Expr *condition, Expr *then_expr, Expr *else_expr);
+  // its value is what the function returns; sets its branches' too
+  void set_tail();
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindIf; }
 };
 
+// Loops that count up to an invariant bound by a whole number, like
+//
+//   for i = start, i < bound, 2 in ...
+//
+// are generated with an integer induction variable and a trip count worked
+// out before the first iteration, which the loop passes understand. Others
+// are generated as written.
 class For : public Expr {
-  std::string loop_var_name;
-  std::unique_ptr<Expr> start, end, step, body;
+  Symbol loop_var_name;
+  Expr *start, *end, *step, *body;
+
+  // the bound and step of a loop that counts from a whole start by a whole
+  // step, or nullptr
+  Expr *get_bound(CodegenContext const &ctx, double &step_value) const;
+  void codegen_counted(CodegenContext &ctx, Expr *bound, double step_value);
+
+public:
+  For(Symbol loop_var_name, Expr *start, Expr *end, Expr *step, Expr *body);
+
+  llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindFor; }
+};
+
+// var x = 1, y in body binds mutable variables for body, each initialized in
+// turn (to 0 without an initializer), and evaluates to body. they live in
+// allocas in the entry block, which mem2reg promotes back into registers.
+class Var : public Expr {
+public:
+  struct Binding {
+    Symbol name;
+    // or nullptr
+    Expr *initializer;
+  };
+
+private:
+  llvm::ArrayRef<Binding> bindings;
+  Expr *body;
 
 public:
-  For(const std::string &loop_var_name, std::unique_ptr<Expr> start,
-      std::unique_ptr<Expr> end, std::unique_ptr<Expr> step,
-      std::unique_ptr<Expr> body);
+  Var(llvm::ArrayRef<Binding> bindings, Expr *body);
+  // its value is what the function returns
+  void set_tail();
 
   llvm::Value *codegen(CodegenContext &ctx) override;
+  void print(llvm::raw_ostream &out) const override;
+  Expr *simplify(Arena &arena) override;
+  void emit(bytecode::Writer &out) const override;
+
+  static bool classof(Expr const *e) { return e->get_kind() == KindVar; }
 };
 
 } // namespace ast
@@ -141,39 +431,66 @@ public:
   };
 
 private:
-  std::map<std::string, int> binary_precedence;
-
   Token current;
+  // where current and the statement being parsed start in the lexer's source
+  size_t current_offset;
+  SourceLocation current_location;
+  size_t statement_offset;
+  // lexed so far
+  size_t tokens;
   bool _peeking;
   std::istream *stream;
+  Lexer *lexer;
+  // where the statement being parsed is allocated
+  ast::Arena *arena;
 
 public:
   bool peeking();
   Token const &peek();
   Token const &next();
+  // only meaningful when parsing from a Lexer
+  size_t peek_offset();
+  SourceLocation peek_location();
+  size_t get_statement_offset() const;
+  size_t get_token_count() const;
+  // forget the peeked token, to parse from another lexer
+  void reset();
 
   // <NumberExpr> ::= <number>
-  std::unique_ptr<ast::NumberExpr> parse_number();
-  std::unique_ptr<ast::Expr> parse_parenthesized();
-
-  // either a variable or a call
-  std::unique_ptr<ast::Expr> parse_identifier();
-  std::unique_ptr<ast::If> parse_if();
-  std::unique_ptr<ast::For> parse_for();
-  std::unique_ptr<ast::Expr> parse_primary();
-  int get_token_precedence(std::string const &token);
-  std::unique_ptr<ast::Expr> parse_expression();
-  std::unique_ptr<ast::Expr> parse_binary_rhs(int lhs_prec,
-                                              std::unique_ptr<ast::Expr> lhs);
-  std::unique_ptr<ast::Prototype> parse_prototype();
-  std::unique_ptr<ast::Function> parse_definition();
-  std::unique_ptr<ast::Prototype> parse_extern();
-  std::unique_ptr<ast::Function> parse_top_level();
+  ast::NumberExpr *parse_number();
+  ast::Expr *parse_parenthesized();
+
+  // a variable or an assignment to it, a call, or an array's element or a
+  // store to it
+  ast::Expr *parse_identifier();
+  ast::If *parse_if();
+  ast::For *parse_for();
+  ast::Var *parse_var();
+  ast::Expr *parse_primary();
+  // the binary operator token spells, if any
+  std::optional<ast::BinaryOp> get_binary_op(Token const &token);
+  int get_token_precedence(Token const &token);
+  ast::Expr *parse_expression();
+  ast::Expr *parse_binary_rhs(int lhs_prec, ast::Expr *lhs);
+  ast::Prototype *parse_prototype();
+  ast::Function *parse_definition();
+  ast::Prototype *parse_extern();
+  ast::Function *parse_top_level();
 
 public:
   Parser();
 
-  std::unique_ptr<ast::Expr> parse(std::istream &s);
+  // the tree is allocated from arena. returns nullptr at the end of the input
+  ast::Expr *parse(std::istream &s, ast::Arena &arena);
+  ast::Expr *parse(Lexer &lexer, ast::Arena &arena);
+  ast::Expr *parse_statement();
+
+  // After a ParseError, skip to where the next statement can start: past a
+  // semicolon, or up to a def, an extern or the end of the input.
+  void synchronize();
+  // report the ParseError at the peeked token of a statement parsed from a
+  // Lexer, quoting the statement's lines up to it from the source
+  void diagnose(std::ostream &errors, ParseError const &e);
 };
 
 #endif
@@ -0,0 +1,165 @@
+#include "Profiler.hpp"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/SymbolSize.h"
+#include <atomic>
+#include <memory>
+#include <unistd.h>
+#ifdef __linux__
+#include <csignal>
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
+
+// seconds of CPU time between samples. the kernel checks timers once a tick,
+// so shorter periods would lose samples.
+static constexpr double sample_period = 0.01;
+
+// the program counters of samples the signal handler has taken, by sample
+// number modulo their count, and 0 once read. a slot that's overwritten before
+// being read loses its sample.
+static constexpr size_t sample_slots = 1 << 16;
+static std::atomic<uintptr_t> sampled_pcs[sample_slots];
+static std::atomic<uint64_t> samples_taken;
+// read up to here
+static uint64_t samples_read;
+
+#ifdef __linux__
+static void take_sample(int, siginfo_t *, void *context) {
+  auto &machine = static_cast<ucontext_t *>(context)->uc_mcontext;
+#if defined(__x86_64__)
+  uintptr_t pc = machine.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  uintptr_t pc = machine.pc;
+#else
+  uintptr_t pc = 0;
+#endif
+  auto n = samples_taken.fetch_add(1, std::memory_order_relaxed);
+  sampled_pcs[n % sample_slots].store(pc, std::memory_order_relaxed);
+}
+#endif
+
+Profiler::Profiler(Options options) : options(options) {
+  if (options.perf) {
+    auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    perf_map = std::fopen(path.c_str(), "w");
+  }
+}
+
+Profiler::~Profiler() {
+  stop();
+  if (perf_map)
+    std::fclose(perf_map);
+}
+
+void Profiler::install(llvm::orc::LLJITBuilder &builder) {
+  builder.setObjectLinkingLayerCreator(
+      [this](llvm::orc::ExecutionSession &es, llvm::Triple const &)
+          -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+        auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+            es, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+        layer->registerJITEventListener(*this);
+        if (options.gdb)
+          layer->registerJITEventListener(
+              *llvm::JITEventListener::createGDBRegistrationListener());
+        // there's no jitdump listener unless LLVM was built with perf support
+        if (options.perf)
+          if (auto jitdump =
+                  llvm::JITEventListener::createPerfJITEventListener())
+            layer->registerJITEventListener(*jitdump);
+        return std::move(layer);
+      });
+}
+
+void Profiler::start() {
+#ifdef __linux__
+  if (!options.sample)
+    return;
+  struct sigaction action = {};
+  action.sa_sigaction = take_sample;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
+
+  itimerval timer = {};
+  timer.it_interval.tv_usec = long(sample_period * 1e6);
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+#endif
+}
+
+void Profiler::stop() {
+#ifdef __linux__
+  if (!options.sample)
+    return;
+  itimerval timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  signal(SIGPROF, SIG_IGN);
+#endif
+}
+
+void Profiler::attribute() {
+  auto taken = samples_taken.load();
+  if (taken - samples_read > sample_slots)
+    samples_read = taken - sample_slots;
+  for (; samples_read < taken; ++samples_read) {
+    auto pc = sampled_pcs[samples_read % sample_slots].exchange(0);
+    if (!pc)
+      continue;
+    auto after = functions.upper_bound(pc);
+    if (after == functions.begin() ||
+        pc >= std::prev(after)->first + std::prev(after)->second.size) {
+      ++unattributed;
+      continue;
+    }
+    ++samples[std::prev(after)->second.name];
+  }
+}
+
+void Profiler::report(TimeReport &report) {
+  std::lock_guard<std::mutex> lock(mutex);
+  attribute();
+  for (auto &function : samples)
+    report.add_samples(function.getKey(), function.getValue(), sample_period);
+  if (unattributed)
+    report.add_samples("(not jitted)", unattributed, sample_period);
+  samples.clear();
+  unattributed = 0;
+}
+
+void Profiler::notifyObjectLoaded(
+    ObjectKey key, llvm::object::ObjectFile const &object,
+    llvm::RuntimeDyld::LoadedObjectInfo const &info) {
+  // the debug object has its sections at the addresses they were loaded at
+  auto loaded = info.getObjectForDebug(object);
+  auto &debug = loaded.getBinary() ? *loaded.getBinary() : object;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto [symbol, size] : llvm::object::computeSymbolSizes(debug)) {
+    auto type = symbol.getType();
+    auto name = symbol.getName();
+    auto address = symbol.getAddress();
+    if (!type || !name || !address ||
+        *type != llvm::object::SymbolRef::ST_Function || !size) {
+      llvm::consumeError(type.takeError());
+      llvm::consumeError(name.takeError());
+      llvm::consumeError(address.takeError());
+      continue;
+    }
+    functions[*address] = {size, name->str(), key};
+    if (perf_map)
+      std::fprintf(perf_map, "%llx %llx %s\n", (unsigned long long)*address,
+                   (unsigned long long)size, name->str().c_str());
+  }
+  if (perf_map)
+    std::fflush(perf_map);
+}
+
+void Profiler::notifyFreeingObject(ObjectKey key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // samples in the object's code have to be counted before its memory can be
+  // reused
+  attribute();
+  for (auto i = functions.begin(); i != functions.end();)
+    i = i->second.object == key ? functions.erase(i) : std::next(i);
+}
@@ -0,0 +1,76 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "TimeReport.hpp"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Making jitted functions visible to debuggers and profilers, and a sampling
+// profiler of its own.
+//
+// Installed on a jit builder, it has the jit link objects with RuntimeDyld so
+// event listeners see them load and unload:
+//  - gdb: registered with GDB's JIT interface, so a debugger attached to the
+//    process can see their symbols and line tables
+//  - perf: written to /tmp/perf-<pid>.map, and to a jitdump file as well when
+//    LLVM was built with perf support, so perf report can name them
+//  - sample: where the process is found on SIGPROF, 100 times a second of
+//    CPU time, is counted against the jitted function it's in. the counts are
+//    added to the time report.
+//
+// It has to outlive the jit. Sampling is Linux only.
+class Profiler : public llvm::JITEventListener {
+public:
+  struct Options {
+    bool gdb = false;
+    bool perf = false;
+    bool sample = false;
+  };
+
+private:
+  struct Code {
+    uint64_t size;
+    std::string name;
+    ObjectKey object;
+  };
+
+  Options options;
+  // guards the rest
+  std::mutex mutex;
+  // jitted functions loaded now, by address
+  std::map<uint64_t, Code> functions;
+  // samples counted against each function, and outside any
+  llvm::StringMap<uint64_t> samples;
+  uint64_t unattributed = 0;
+  std::FILE *perf_map = nullptr;
+
+  // count the samples taken since last time against the functions loaded now
+  void attribute();
+
+public:
+  explicit Profiler(Options options);
+  ~Profiler() override;
+
+  // link the objects of the jit built by builder where listeners see them
+  void install(llvm::orc::LLJITBuilder &builder);
+
+  // start and stop sampling, with options.sample
+  void start();
+  void stop();
+
+  // add the samples counted so far to report
+  void report(TimeReport &report);
+
+  void notifyObjectLoaded(ObjectKey key, llvm::object::ObjectFile const &object,
+                          llvm::RuntimeDyld::LoadedObjectInfo const &info)
+      override;
+  void notifyFreeingObject(ObjectKey key) override;
+};
+
+#endif
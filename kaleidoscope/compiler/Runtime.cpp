@@ -0,0 +1,101 @@
+#include "Runtime.hpp"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include <cmath>
+
+using Unary = double (*)(double);
+using Binary = double (*)(double, double);
+
+static constexpr std::pair<char const *, Unary> unary[] = {
+    {"sin", ::sin},     {"cos", ::cos},     {"tan", ::tan},
+    {"asin", ::asin},   {"acos", ::acos},   {"atan", ::atan},
+    {"sinh", ::sinh},   {"cosh", ::cosh},   {"tanh", ::tanh},
+    {"exp", ::exp},     {"exp2", ::exp2},   {"log", ::log},
+    {"log2", ::log2},   {"log10", ::log10}, {"sqrt", ::sqrt},
+    {"cbrt", ::cbrt},   {"fabs", ::fabs},   {"floor", ::floor},
+    {"ceil", ::ceil},   {"trunc", ::trunc}, {"round", ::round},
+};
+
+static constexpr std::pair<char const *, Binary> binary[] = {
+    {"pow", ::pow},     {"atan2", ::atan2}, {"fmod", ::fmod},
+    {"hypot", ::hypot}, {"fmin", ::fmin},   {"fmax", ::fmax},
+    {"copysign", ::copysign},
+};
+
+namespace {
+
+// defines whichever of the runtime's functions a lookup asks for
+class RuntimeGenerator : public llvm::orc::DefinitionGenerator {
+  llvm::orc::SymbolMap symbols;
+
+public:
+  explicit RuntimeGenerator(llvm::orc::LLJIT &jit) {
+    auto add = [&](char const *name, auto function) {
+      symbols[jit.mangleAndIntern(name)] = llvm::orc::ExecutorSymbolDef(
+          llvm::orc::ExecutorAddr::fromPtr(function),
+          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    };
+    for (auto [name, function] : unary)
+      add(name, function);
+    for (auto [name, function] : binary)
+      add(name, function);
+  }
+
+  llvm::Error
+  tryToGenerate(llvm::orc::LookupState &, llvm::orc::LookupKind,
+                llvm::orc::JITDylib &dylib, llvm::orc::JITDylibLookupFlags,
+                llvm::orc::SymbolLookupSet const &names) override {
+    llvm::orc::SymbolMap found;
+    for (auto &[name, flags] : names) {
+      auto symbol = symbols.find(name);
+      if (symbol != symbols.end())
+        found.insert(*symbol);
+    }
+    if (found.empty())
+      return llvm::Error::success();
+    return dylib.define(llvm::orc::absoluteSymbols(std::move(found)));
+  }
+};
+
+} // namespace
+
+llvm::Error link_runtime(llvm::orc::LLJIT &jit) {
+  auto process =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          jit.getDataLayout().getGlobalPrefix());
+  if (!process)
+    return process.takeError();
+  auto &runtime = jit.getExecutionSession().createBareJITDylib("runtime");
+  runtime.addGenerator(std::make_unique<RuntimeGenerator>(jit));
+  runtime.addGenerator(std::move(*process));
+
+  // ahead of the dylibs main already links against, which can include one
+  // that searches the process itself
+  auto &main = jit.getMainJITDylib();
+  llvm::orc::JITDylibSearchOrder order = {
+      {&runtime, llvm::orc::JITDylibLookupFlags::MatchExportedSymbolsOnly}};
+  main.withLinkOrderDo([&](llvm::orc::JITDylibSearchOrder const &links) {
+    for (auto &link : links)
+      if (link.first != &main)
+        order.push_back(link);
+  });
+  main.setLinkOrder(std::move(order));
+  return llvm::Error::success();
+}
+
+void *find_runtime_symbol(llvm::StringRef name) {
+  for (auto [known, function] : unary)
+    if (name == known)
+      return reinterpret_cast<void *>(function);
+  for (auto [known, function] : binary)
+    if (name == known)
+      return reinterpret_cast<void *>(function);
+  // makes the process's own symbols searchable, once
+  static bool const loaded =
+      !llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  if (!loaded)
+    return nullptr;
+  return llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name.str());
+}
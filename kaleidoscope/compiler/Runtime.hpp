@@ -0,0 +1,19 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/Error.h"
+
+// Where externs are found: the C library functions scripts usually declare,
+// at their addresses in this process, so they need no search of its symbol
+// table, and then the rest of the process's symbols. Generators on a runtime
+// dylib define each there as it's linked against, and the jit's main dylib
+// links against that after itself, so a script's own definition of one of the
+// names comes first. Call it before creating dylibs that copy main's links.
+llvm::Error link_runtime(llvm::orc::LLJIT &jit);
+
+// the address of the function an extern called name links against, without a
+// jit: one of those, or else the process's symbol of that name, or nullptr
+void *find_runtime_symbol(llvm::StringRef name);
+
+#endif
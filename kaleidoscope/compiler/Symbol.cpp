@@ -0,0 +1,18 @@
+#include "Symbol.hpp"
+#include <mutex>
+#include <shared_mutex>
+
+Symbol Symbol::intern(llvm::StringRef name) {
+  // entries are allocated separately, so they don't move when the table grows
+  static std::shared_mutex mutex;
+  static llvm::StringMap<unsigned> table;
+
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    if (auto e = table.find(name); e != table.end())
+      return &*e;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  return &*table.try_emplace(name, table.size()).first;
+}
@@ -0,0 +1,48 @@
+#ifndef SYMBOL_HPP
+#define SYMBOL_HPP
+
+#include "llvm/ADT/DenseMapInfo.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+// An interned name. Symbols for equal names are equal, so comparing one never
+// touches its characters, and the text lives as long as the process.
+class Symbol {
+  using Entry = llvm::StringMapEntry<unsigned>;
+  Entry const *entry;
+
+  friend struct llvm::DenseMapInfo<Symbol>;
+
+  Symbol(Entry const *entry) : entry(entry) {}
+
+public:
+  Symbol() : entry(nullptr) {}
+
+  // thread safe; looking up a name that is already interned only takes a
+  // shared lock
+  static Symbol intern(llvm::StringRef name);
+
+  llvm::StringRef str() const { return entry ? entry->getKey() : ""; }
+
+  // small and dense: symbols are numbered in the order they were interned
+  unsigned id() const { return entry->getValue(); }
+
+  bool operator==(Symbol that) const { return entry == that.entry; }
+  bool operator!=(Symbol that) const { return entry != that.entry; }
+};
+
+// so symbols can key DenseMaps and DenseSets
+namespace llvm {
+template <> struct DenseMapInfo<Symbol> {
+  using Entries = DenseMapInfo<Symbol::Entry const *>;
+
+  static Symbol getEmptyKey() { return Entries::getEmptyKey(); }
+  static Symbol getTombstoneKey() { return Entries::getTombstoneKey(); }
+  static unsigned getHashValue(Symbol s) {
+    return Entries::getHashValue(s.entry);
+  }
+  static bool isEqual(Symbol a, Symbol b) { return a == b; }
+};
+} // namespace llvm
+
+#endif
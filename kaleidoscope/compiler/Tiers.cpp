@@ -0,0 +1,260 @@
+#include "Tiers.hpp"
+#include "ObjectEmitter.hpp"
+#include "Optimizer.hpp"
+#include "TimeReport.hpp"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+// what instrumented code calls, and what it passes along
+static char const *const tier_up_symbol = "kaleidoscope.tier_up";
+static char const *const tiers_symbol = "kaleidoscope.tiers";
+
+struct Tiers::Function {
+  // the functions with stubs
+  std::vector<std::string> names;
+  // as generated, to optimize for the hot version
+  llvm::orc::ThreadSafeModule source;
+
+  // guards the rest
+  std::mutex mutex;
+  llvm::orc::ResourceTrackerSP cold, hot;
+  bool retired = false;
+};
+
+Tiers::Definition::Definition(std::shared_ptr<Function> function)
+    : function(std::move(function)) {}
+
+Tiers::Definition::~Definition() {
+  llvm::orc::ResourceTrackerSP cold, hot;
+  {
+    std::lock_guard<std::mutex> lock(function->mutex);
+    function->retired = true;
+    cold = std::move(function->cold);
+    hot = std::move(function->hot);
+  }
+  if (cold)
+    llvm::ExitOnError()(cold->remove());
+  if (hot)
+    llvm::ExitOnError()(hot->remove());
+}
+
+Tiers::Tiers(llvm::orc::LLJIT &jit, LazyDefinitions &definitions,
+             unsigned threshold, std::unique_ptr<llvm::TargetMachine> tm)
+    : jit(jit), definitions(definitions), threshold(threshold),
+      tm(std::move(tm)), compiler([this] {
+        while (auto id = hot.pop()) {
+          if (!stopping)
+            compile(*id);
+          hot.done();
+        }
+      }) {}
+
+Tiers::~Tiers() {
+  stopping = true;
+  hot.close();
+  compiler.join();
+}
+
+llvm::Expected<std::unique_ptr<Tiers>>
+Tiers::create(llvm::orc::LLJIT &jit, LazyDefinitions &definitions,
+              unsigned threshold) {
+  auto tm = create_host_target_machine(3);
+  if (!tm)
+    return tm.takeError();
+
+  std::unique_ptr<Tiers> tiers(
+      new Tiers(jit, definitions, threshold, std::move(*tm)));
+
+  llvm::orc::SymbolMap symbols;
+  symbols[jit.mangleAndIntern(tier_up_symbol)] = llvm::orc::ExecutorSymbolDef(
+      llvm::orc::ExecutorAddr::fromPtr(&tier_up),
+      llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+  symbols[jit.mangleAndIntern(tiers_symbol)] = llvm::orc::ExecutorSymbolDef(
+      llvm::orc::ExecutorAddr::fromPtr(tiers.get()),
+      llvm::JITSymbolFlags::Exported);
+  if (auto err = jit.getMainJITDylib().define(
+          llvm::orc::absoluteSymbols(std::move(symbols))))
+    return std::move(err);
+  return std::move(tiers);
+}
+
+// count calls on entry to f, and have the threshold-th one tier id up. the
+// count is a monotonic load and store, which on x86-64 are the same movs as
+// plain ones, rather than an atomicrmw, whose locked add makes cold code
+// several times slower. racing calls can only add to the threshold, or tier up
+// more than once.
+static void instrument(llvm::Function &f, unsigned id, unsigned threshold) {
+  auto &module = *f.getParent();
+  auto &ctx = module.getContext();
+  llvm::IRBuilder<> builder(ctx);
+
+  auto counter = new llvm::GlobalVariable(
+      module, builder.getInt64Ty(), false, llvm::GlobalValue::PrivateLinkage,
+      builder.getInt64(0), f.getName() + ".calls");
+  counter->setAlignment(llvm::Align(8));
+  auto tiers = module.getOrInsertGlobal(tiers_symbol, builder.getInt8Ty());
+  auto tier_up = module.getOrInsertFunction(
+      tier_up_symbol, builder.getVoidTy(), builder.getInt8PtrTy(),
+      builder.getInt64Ty());
+
+  auto body = &f.getEntryBlock();
+  auto count = llvm::BasicBlock::Create(ctx, "count", &f, body);
+  auto up = llvm::BasicBlock::Create(ctx, "tierup", &f, body);
+
+  // the allocas of var and for move along to the new entry block, where
+  // mem2reg and SROA look for them
+  builder.SetInsertPoint(count);
+  for (auto i = body->begin(); i != body->end();) {
+    auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*i++);
+    if (alloca && llvm::isa<llvm::ConstantInt>(alloca->getArraySize())) {
+      alloca->removeFromParent();
+      builder.Insert(alloca);
+    }
+  }
+
+  auto calls =
+      builder.CreateAlignedLoad(builder.getInt64Ty(), counter, llvm::Align(8));
+  calls->setAtomic(llvm::AtomicOrdering::Monotonic);
+  builder
+      .CreateAlignedStore(builder.CreateAdd(calls, builder.getInt64(1)),
+                          counter, llvm::Align(8))
+      ->setAtomic(llvm::AtomicOrdering::Monotonic);
+  builder.CreateCondBr(
+      builder.CreateICmpEQ(calls, builder.getInt64(threshold - 1)), up, body);
+
+  builder.SetInsertPoint(up);
+  builder.CreateCall(tier_up, {tiers, builder.getInt64(id)});
+  builder.CreateBr(body);
+}
+
+llvm::Expected<std::unique_ptr<Tiers::Definition>>
+Tiers::add(llvm::orc::ThreadSafeModule module) {
+  auto function = std::make_shared<Function>();
+  unsigned id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    id = next_id++;
+    functions[id] = function;
+  }
+  function->source = llvm::orc::cloneToNewContext(module);
+  function->cold = definitions.get_bodies().createResourceTracker();
+  auto definition = std::make_unique<Definition>(function);
+
+  // cold bodies call each other (and themselves) through the stubs too, so
+  // that a long running call moves to the hot version as well
+  llvm::orc::SymbolAliasMap stubs;
+  module.withModuleDo([&](llvm::Module &m) {
+    std::vector<llvm::Function *> bodies;
+    for (auto &f : m.functions())
+      if (!f.isDeclaration())
+        bodies.push_back(&f);
+
+    for (auto f : bodies) {
+      instrument(*f, id, threshold);
+      if (f->hasLocalLinkage())
+        continue;
+
+      std::string name(f->getName());
+      f->setName(name + ".cold");
+      auto stub = llvm::Function::Create(f->getFunctionType(),
+                                         llvm::GlobalValue::ExternalLinkage,
+                                         name, m);
+      f->replaceAllUsesWith(stub);
+      stubs[jit.mangleAndIntern(name)] = llvm::orc::SymbolAliasMapEntry(
+          jit.mangleAndIntern(f->getName()),
+          llvm::JITSymbolFlags::fromGlobalValue(*f));
+      function->names.push_back(std::move(name));
+    }
+  });
+
+  if (auto err = definitions.add(function->cold, std::move(module),
+                                 std::move(stubs)))
+    return std::move(err);
+  return std::move(definition);
+}
+
+void Tiers::tier_up(Tiers *tiers, uint64_t id) { tiers->hot.push(id); }
+
+void Tiers::compile(unsigned id) {
+  auto &es = jit.getExecutionSession();
+  std::shared_ptr<Function> function;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    function = functions.lookup(id).lock();
+    // removed since
+    if (!function) {
+      functions.erase(id);
+      return;
+    }
+  }
+  {
+    // already tiered up by racing calls
+    std::lock_guard<std::mutex> lock(function->mutex);
+    if (function->hot || function->retired)
+      return;
+  }
+
+  auto module = llvm::orc::cloneToNewContext(function->source);
+  auto object = module.withModuleDo([&](llvm::Module &m) {
+    for (auto &f : m.functions())
+      if (!f.isDeclaration())
+        f.setName(f.getName() + ".hot");
+    Optimizer(3).run(m);
+    TimeReport::Timer timer(TimeReport::Compile);
+    return llvm::orc::SimpleCompiler(*tm)(m);
+  });
+  if (!object)
+    return es.reportError(object.takeError());
+
+  auto &bodies = definitions.get_bodies();
+  auto tracker = bodies.createResourceTracker();
+  if (auto err = jit.addObjectFile(tracker, std::move(*object)))
+    return es.reportError(std::move(err));
+
+  std::vector<llvm::orc::ExecutorAddr> hot_bodies;
+  for (auto &name : function->names) {
+    auto body = jit.lookup(bodies, name + ".hot");
+    if (!body) {
+      es.reportError(body.takeError());
+      llvm::ExitOnError()(tracker->remove());
+      return;
+    }
+    hot_bodies.push_back(*body);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(function->mutex);
+    if (!function->retired) {
+      for (size_t i = 0; i < hot_bodies.size(); ++i)
+        if (auto err = definitions.redirect(function->names[i], hot_bodies[i]))
+          es.reportError(std::move(err));
+      function->hot = std::move(tracker);
+    }
+  }
+  if (!tracker) {
+    std::lock_guard<std::mutex> lock(mutex);
+    swapped.push_back(function);
+    return;
+  }
+  llvm::ExitOnError()(tracker->remove());
+}
+
+void Tiers::release_cold() {
+  std::vector<std::shared_ptr<Function>> functions;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    functions.swap(swapped);
+  }
+
+  std::vector<llvm::orc::ResourceTrackerSP> cold;
+  for (auto &function : functions) {
+    std::lock_guard<std::mutex> lock(function->mutex);
+    if (function->cold)
+      cold.push_back(std::move(function->cold));
+  }
+  for (auto &tracker : cold)
+    llvm::ExitOnError()(tracker->remove());
+}
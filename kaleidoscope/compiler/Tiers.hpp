@@ -0,0 +1,81 @@
+#ifndef TIERS_HPP
+#define TIERS_HPP
+
+#include "Channel.hpp"
+#include "LazyDefinitions.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tiered compilation of lazy definitions.
+//
+// A definition's cold version is compiled at the jit's own level, with a
+// counter on entry to each of its functions. The call that takes a counter to
+// the threshold queues an unoptimized copy of the definition to be optimized
+// at -O3 and compiled on a background thread, after which the functions' stubs
+// are pointed at the hot version.
+//
+// Cold code can still be running when its stubs are redirected, so it's only
+// released by release_cold(), which has to be called where no jitted code is.
+//
+// Definitions may outlive their Tiers, which should go first so nothing is
+// being recompiled while they're removed.
+class Tiers {
+public:
+  struct Function;
+
+  // removes a definition's cold and hot versions, and stops it from being
+  // swapped to a hot one it no longer has stubs for
+  class Definition {
+    std::shared_ptr<Function> function;
+
+  public:
+    Definition(std::shared_ptr<Function> function);
+    ~Definition();
+  };
+
+private:
+  llvm::orc::LLJIT &jit;
+  LazyDefinitions &definitions;
+  unsigned threshold;
+  std::unique_ptr<llvm::TargetMachine> tm;
+
+  std::mutex mutex;
+  llvm::DenseMap<unsigned, std::weak_ptr<Function>> functions;
+  unsigned next_id = 0;
+  std::vector<std::shared_ptr<Function>> swapped;
+
+  Channel<unsigned> hot;
+  std::atomic<bool> stopping{false};
+  std::thread compiler;
+
+  Tiers(llvm::orc::LLJIT &jit, LazyDefinitions &definitions,
+        unsigned threshold, std::unique_ptr<llvm::TargetMachine> tm);
+
+  static void tier_up(Tiers *tiers, uint64_t id);
+  void compile(unsigned id);
+
+public:
+  // definitions has to go to the same jit
+  static llvm::Expected<std::unique_ptr<Tiers>>
+  create(llvm::orc::LLJIT &jit, LazyDefinitions &definitions,
+         unsigned threshold);
+  ~Tiers();
+
+  // like LazyDefinitions::add. the definition owns the bodies.
+  llvm::Expected<std::unique_ptr<Definition>>
+  add(llvm::orc::ThreadSafeModule module);
+
+  // remove the cold versions of definitions that have been swapped out
+  void release_cold();
+};
+
+#endif
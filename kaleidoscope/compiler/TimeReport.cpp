@@ -0,0 +1,234 @@
+#include "TimeReport.hpp"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// indexed by Phase and Counter
+static char const *const phase_names[] = {
+    "lex",     "parse", "simplify", "codegen", "optimize",
+    "compile", "add",   "lookup",   "execute"};
+static char const *const counter_names[] = {
+    "tokens", "ast_nodes", "ir_instructions", "modules_compiled",
+    "machine_code_bytes"};
+
+static std::unique_ptr<TimeReport> report;
+
+TimeReport &TimeReport::enable() {
+  if (!report) {
+    report.reset(new TimeReport);
+    llvm::TimePassesIsEnabled = true;
+  }
+  return *report;
+}
+
+TimeReport *TimeReport::active() { return report.get(); }
+
+TimeReport::Timer::Timer(Phase phase) : report(active()), phase(phase) {
+  if (report)
+    start = llvm::TimeRecord::getCurrentTime(true);
+}
+
+TimeReport::Timer::~Timer() {
+  if (!report)
+    return;
+  auto time = llvm::TimeRecord::getCurrentTime(false);
+  time -= start;
+  report->add(phase, time);
+}
+
+void TimeReport::add(Phase phase, llvm::TimeRecord const &time) {
+  std::lock_guard<std::mutex> lock(mutex);
+  phases[phase] += time;
+  ++runs[phase];
+}
+
+void TimeReport::add_pass(llvm::StringRef pass, llvm::TimeRecord const &time) {
+  std::lock_guard<std::mutex> lock(mutex);
+  passes[pass] += time;
+}
+
+void TimeReport::add_samples(llvm::StringRef function, uint64_t samples,
+                             double period) {
+  std::lock_guard<std::mutex> lock(mutex);
+  functions[function] += samples * period;
+}
+
+void TimeReport::instrument(llvm::PassInstrumentationCallbacks &callbacks) {
+  // pass managers and adaptors only run other passes
+  static std::vector<llvm::StringRef> const runners = {
+      "PassManager", "PassAdaptor", "AnalysisManagerProxy",
+      "ModuleInlinerWrapperPass", "DevirtSCCRepeatedPass"};
+
+  struct Running {
+    llvm::StringRef pass;
+    llvm::TimeRecord since;
+  };
+  // shared by the callbacks, which live as long as the pass builder's run
+  auto running = std::make_shared<std::vector<Running>>();
+
+  // charge the innermost pass for its time up to now
+  auto pause = [this, running] {
+    if (running->empty())
+      return;
+    auto time = llvm::TimeRecord::getCurrentTime(false);
+    time -= running->back().since;
+    add_pass(running->back().pass, time);
+  };
+
+  callbacks.registerBeforeNonSkippedPassCallback(
+      [running, pause](llvm::StringRef pass, auto &&...) {
+        if (llvm::isSpecialPass(pass, runners))
+          return;
+        pause();
+        running->push_back({pass, llvm::TimeRecord::getCurrentTime(true)});
+      });
+  auto finish = [running, pause](llvm::StringRef pass, auto &&...) {
+    if (llvm::isSpecialPass(pass, runners) || running->empty())
+      return;
+    pause();
+    running->pop_back();
+    if (!running->empty())
+      running->back().since = llvm::TimeRecord::getCurrentTime(true);
+  };
+  callbacks.registerAfterPassCallback(finish);
+  callbacks.registerAfterPassInvalidatedCallback(finish);
+}
+
+// when the module being compiled on this thread was handed to the compiler
+static thread_local std::optional<llvm::TimeRecord> compile_start;
+
+void TimeReport::compile_starts() {
+  if (active())
+    compile_start = llvm::TimeRecord::getCurrentTime(true);
+}
+
+void TimeReport::install(llvm::orc::LLJIT &jit) {
+  jit.getObjTransformLayer().setTransform(
+      [this](std::unique_ptr<llvm::MemoryBuffer> object)
+          -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+        if (compile_start) {
+          auto time = llvm::TimeRecord::getCurrentTime(false);
+          time -= *compile_start;
+          add(Compile, time);
+          compile_start.reset();
+        }
+
+        count(Modules);
+        auto file = llvm::object::ObjectFile::createObjectFile(
+            object->getMemBufferRef());
+        if (!file) {
+          llvm::consumeError(file.takeError());
+          return object;
+        }
+        for (auto &section : (*file)->sections())
+          if (section.isText())
+            count(CodeBytes, section.getSize());
+        return object;
+      });
+}
+
+void TimeReport::print(llvm::raw_ostream &out) {
+  {
+    llvm::StringMap<llvm::TimeRecord> records;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (unsigned i = 0; i < phase_count; ++i)
+      if (runs[i])
+        records[phase_names[i]] = phases[i];
+    llvm::TimerGroup("kaleidoscope", "Kaleidoscope phases", records)
+        .print(out);
+
+    if (!passes.empty())
+      llvm::TimerGroup("passes", "Optimization passes", passes).print(out);
+
+    if (!functions.empty()) {
+      // busiest first
+      std::vector<std::pair<double, llvm::StringRef>> sorted;
+      double total = 0;
+      for (auto &function : functions) {
+        sorted.push_back({function.getValue(), function.getKey()});
+        total += function.getValue();
+      }
+      std::sort(sorted.begin(), sorted.end(), std::greater<>());
+
+      out << "===" << std::string(73, '-') << "===\n"
+          << std::string(23, ' ') << "Kaleidoscope functions (sampled)\n"
+          << "===" << std::string(73, '-') << "===\n"
+          << llvm::format("  Total CPU time: %.4f seconds\n\n", total)
+          << "   ---CPU Time---  --Name--\n";
+      for (auto &[seconds, name] : sorted)
+        out << llvm::format("   %7.4f (%5.1f%%)  ", seconds,
+                            100 * seconds / total)
+            << name << '\n';
+      out << '\n';
+    }
+  }
+
+  out << "===" << std::string(73, '-') << "===\n"
+      << std::string(29, ' ') << "Kaleidoscope counters\n"
+      << "===" << std::string(73, '-') << "===\n";
+  for (unsigned i = 0; i < counter_count; ++i)
+    out << llvm::format("  %14llu  %s\n",
+                        (unsigned long long)counters[i].load(),
+                        counter_names[i]);
+  out << '\n';
+
+  llvm::reportAndResetTimings(&out);
+}
+
+void TimeReport::print_json(llvm::raw_ostream &out) {
+  auto record = [](llvm::json::OStream &json, llvm::TimeRecord const &time) {
+    json.attribute("wall", time.getWallTime());
+    json.attribute("user", time.getUserTime());
+    json.attribute("system", time.getSystemTime());
+  };
+
+  llvm::json::OStream json(out, 2);
+  json.objectBegin();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    json.attributeObject("phases", [&] {
+      for (unsigned i = 0; i < phase_count; ++i)
+        if (runs[i])
+          json.attributeObject(phase_names[i], [&] {
+            record(json, phases[i]);
+            json.attribute("runs", runs[i]);
+          });
+    });
+    json.attributeObject("passes", [&] {
+      for (auto &pass : passes)
+        json.attributeObject(pass.getKey(),
+                             [&] { record(json, pass.getValue()); });
+    });
+    // CPU seconds
+    json.attributeObject("functions", [&] {
+      for (auto &function : functions)
+        json.attribute(function.getKey(), function.getValue());
+    });
+  }
+  json.attributeObject("counters", [&] {
+    for (unsigned i = 0; i < counter_count; ++i)
+      json.attribute(counter_names[i], int64_t(counters[i].load()));
+  });
+  // the code generator's passes, as LLVM prints them
+  json.attributeBegin("llvm");
+  json.rawValue([](llvm::raw_ostream &out) {
+    out << '{';
+    llvm::TimerGroup::printAllJSONValues(out, "");
+    out << "\n}";
+  });
+  json.attributeEnd();
+  json.objectEnd();
+  out << '\n';
+
+  // printed already
+  llvm::reportAndResetTimings(&llvm::nulls());
+}
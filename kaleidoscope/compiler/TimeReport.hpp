@@ -0,0 +1,96 @@
+#ifndef TIME_REPORT_HPP
+#define TIME_REPORT_HPP
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+// Where a run's time goes: the time spent in each phase, the time of each
+// optimization pass, and counts of what went through them. LLVM's own timings
+// of the code generator's passes are enabled along with it, and printed in the
+// same report, as are the times of jitted functions when a Profiler samples
+// them.
+//
+// Phases on the compile threads overlap each other and the main thread, so
+// their totals can add up to more than the run took.
+//
+// There's one report per process, which is only kept once enabled; everything
+// else is a no-op until then.
+class TimeReport {
+public:
+  enum Phase {
+    Lex,
+    Parse,
+    Simplify,
+    Codegen,
+    Optimize,
+    Compile,
+    Add,
+    Lookup,
+    Execute,
+    phase_count
+  };
+
+  enum Counter {
+    Tokens,
+    Nodes,
+    Instructions,
+    Modules,
+    CodeBytes,
+    counter_count
+  };
+
+  // times a phase from construction to destruction, while there's a report
+  class Timer {
+    TimeReport *report;
+    Phase phase;
+    llvm::TimeRecord start;
+
+  public:
+    explicit Timer(Phase phase);
+    ~Timer();
+  };
+
+private:
+  std::mutex mutex;
+  llvm::TimeRecord phases[phase_count];
+  unsigned runs[phase_count] = {};
+  llvm::StringMap<llvm::TimeRecord> passes;
+  // seconds sampled in each jitted function
+  llvm::StringMap<double> functions;
+  std::atomic<uint64_t> counters[counter_count] = {};
+
+  TimeReport() = default;
+
+public:
+  static TimeReport &enable();
+  // nullptr unless enabled
+  static TimeReport *active();
+
+  void add(Phase phase, llvm::TimeRecord const &time);
+  void add_pass(llvm::StringRef pass, llvm::TimeRecord const &time);
+  void count(Counter counter, uint64_t n = 1) { counters[counter] += n; }
+  // charge function with samples taken period seconds of CPU time apart
+  void add_samples(llvm::StringRef function, uint64_t samples, double period);
+
+  // time the passes a pass builder's pipelines run. each pass's time leaves
+  // out the passes it runs itself.
+  void instrument(llvm::PassInstrumentationCallbacks &callbacks);
+
+  // count the modules the jit compiles and the machine code they come to, and
+  // time compiling them. the jit compiles a module on the thread that
+  // transformed it, right after the transform, which calls compile_starts().
+  void install(llvm::orc::LLJIT &jit);
+  static void compile_starts();
+
+  // as tables, or as one JSON object. either resets LLVM's pass timings.
+  void print(llvm::raw_ostream &out);
+  void print_json(llvm::raw_ostream &out);
+};
+
+#endif
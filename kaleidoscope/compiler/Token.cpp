@@ -42,11 +42,13 @@ std::istream &operator>>(std::istream &s, Token &t) {
             {"def", Token::TypeDef},   {"extern", Token::TypeExtern},
             {"if", Token::TypeIf},     {"then", Token::TypeThen},
             {"else", Token::TypeElse}, {"for", Token::TypeFor},
-            {"in", Token::TypeIn},
+            {"in", Token::TypeIn},     {"var", Token::TypeVar},
         };
 
     if (auto e = special_ids.find(t.literal); e != special_ids.end())
       t.type = e->second;
+    else
+      t.symbol = Symbol::intern(t.literal);
 
     return s;
   }
@@ -82,6 +84,14 @@ std::istream &operator>>(std::istream &s, Token &t) {
     t.type = Token::TypeRpar;
     t.literal = ')';
     return s;
+  case '[':
+    t.type = Token::TypeLbracket;
+    t.literal = '[';
+    return s;
+  case ']':
+    t.type = Token::TypeRbracket;
+    t.literal = ']';
+    return s;
   case ';':
     t.type = Token::TypeSemicolon;
     t.literal = ';';
@@ -98,9 +108,10 @@ std::istream &operator>>(std::istream &s, Token &t) {
     t.literal.push_back(c);
     c = s.get();
   } while (!(s.eof() || isspace(c) || isalnum(c) || c == '.' || c == '(' ||
-             c == ')' || c == ';'));
+             c == ')' || c == '[' || c == ']' || c == ';'));
   s.unget();
   s.clear();
+  t.symbol = Symbol::intern(t.literal);
 
   return s;
 }
@@ -1,6 +1,7 @@
 #ifndef TOKEN_HPP
 #define TOKEN_HPP
 
+#include "Symbol.hpp"
 #include <istream>
 #include <ostream>
 #include <string>
@@ -15,6 +16,8 @@ class Token {
   TT(Number)                                                                   \
   TT(Lpar)                                                                     \
   TT(Rpar)                                                                     \
+  TT(Lbracket)                                                                 \
+  TT(Rbracket)                                                                 \
   TT(Operator)                                                                 \
   TT(Semicolon)                                                                \
   TT(Comma)                                                                    \
@@ -22,7 +25,8 @@ class Token {
   TT(Then)                                                                     \
   TT(Else)                                                                     \
   TT(For)                                                                      \
-  TT(In)
+  TT(In)                                                                       \
+  TT(Var)
 
 #define TT(x) #x,
   constexpr static char const *const type_str[] = {TOKENTYPES};
@@ -37,6 +41,9 @@ public:
 
   std::string literal;
   double number;
+  // the interned literal of identifiers and operators. not compared, since it
+  // follows from literal.
+  Symbol symbol;
 
   bool operator==(const Token &) const;
   bool operator!=(const Token &) const;
@@ -0,0 +1,79 @@
+#ifndef WORK_STEALING_HPP
+#define WORK_STEALING_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Calls f(i) for every i in [0, count) on up to threads threads, returning
+// once all the calls have.
+//
+// Each thread starts with an even share of the indices, which it works through
+// from the front. One that runs out steals the back half of whatever is left
+// in another's share, so a few slow calls don't hold up the rest. Indices are
+// handed out in no particular order; f has to be safe to call concurrently.
+template <typename F>
+void parallel_for(size_t count, unsigned threads, F &&f) {
+  threads = std::max(1u, unsigned(std::min<size_t>(threads, count)));
+  if (threads == 1) {
+    for (size_t i = 0; i < count; ++i)
+      f(i);
+    return;
+  }
+
+  // [begin, end) of the indices a thread has yet to start
+  struct Share {
+    std::mutex mutex;
+    size_t begin, end;
+  };
+  std::unique_ptr<Share[]> shares(new Share[threads]);
+  for (unsigned t = 0; t < threads; ++t) {
+    shares[t].begin = count * t / threads;
+    shares[t].end = count * (t + 1) / threads;
+  }
+
+  auto take = [&](unsigned self) -> std::optional<size_t> {
+    auto &own = shares[self];
+    std::unique_lock<std::mutex> lock(own.mutex);
+    if (own.begin < own.end)
+      return own.begin++;
+    lock.unlock();
+
+    // nothing of our own left: refill from the next thread with work. every
+    // index is in exactly one share, so any we miss while others steal will
+    // still be started by whoever holds it.
+    for (unsigned k = 1; k < threads; ++k) {
+      auto &victim = shares[(self + k) % threads];
+      std::scoped_lock both(own.mutex, victim.mutex);
+      if (victim.begin == victim.end)
+        continue;
+      auto middle = victim.end - (victim.end - victim.begin) / 2;
+      own.begin = middle;
+      own.end = victim.end;
+      victim.end = middle;
+      if (own.begin == own.end)
+        // a single index left: take it
+        return --victim.end;
+      return own.begin++;
+    }
+    return std::nullopt;
+  };
+
+  auto work = [&](unsigned self) {
+    while (auto i = take(self))
+      f(*i);
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t)
+    workers.emplace_back(work, t);
+  work(0);
+  for (auto &worker : workers)
+    worker.join();
+}
+
+#endif
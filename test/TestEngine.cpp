@@ -0,0 +1,119 @@
+#include "kaleidoscope/compiler/Engine.hpp"
+#include "llvm/Support/Error.h"
+#include <iostream>
+
+int main() {
+  llvm::ExitOnError ExitOnErr;
+  auto engine = ExitOnErr(Engine::create());
+
+  auto handle = ExitOnErr(engine->compile("def f(x y) x * y + 1;\n"
+                                          "def g(x) f(x, x);\n"));
+  auto f = ExitOnErr(engine->lookup<double(double, double)>("f"));
+  auto g = ExitOnErr(engine->lookup<double(double)>("g"));
+  if (f(2, 3) != 7 || g(3) != 10) {
+    std::cerr << "Expected 7 and 10, got " << f(2, 3) << " and " << g(3)
+              << ".\n";
+    return 1;
+  }
+
+  auto wrong_type = engine->lookup<double(double)>("f");
+  auto redefinition = engine->compile("def f(x) x;");
+  auto expression = engine->compile("f(1, 2);");
+  if (wrong_type || redefinition || expression) {
+    std::cerr << "Expected a mistyped lookup, a redefinition and a top level "
+                 "expression to fail.\n";
+    return 1;
+  }
+  llvm::consumeError(wrong_type.takeError());
+  llvm::consumeError(redefinition.takeError());
+  llvm::consumeError(expression.takeError());
+
+  // an extern can't change the type of a live definition, and a source that
+  // fails leaves no declarations behind
+  auto mismatch = engine->compile("extern f(x);");
+  auto failed = engine->compile("extern k(x);\n"
+                                "def m(x) x;\n"
+                                "def m(x) x;\n");
+  auto declared = engine->lookup<double(double)>("k");
+  if (mismatch || failed || declared) {
+    std::cerr << "Expected an extern of f with one argument to fail, and a "
+                 "failed source to declare nothing.\n";
+    return 1;
+  }
+  llvm::consumeError(mismatch.takeError());
+  llvm::consumeError(failed.takeError());
+  llvm::consumeError(declared.takeError());
+  ExitOnErr(engine->lookup<double(double, double)>("f"));
+
+  // f can be redefined once its source is gone
+  handle = {};
+  auto redefined = ExitOnErr(engine->compile("def f(x) x - 1;"));
+  auto f1 = ExitOnErr(engine->lookup<double(double)>("f"));
+  if (f1(1) != 0) {
+    std::cerr << "Expected the redefinition of f to return 0, got " << f1(1)
+              << ".\n";
+    return 1;
+  }
+
+  // linking against the runtime's sin doesn't stop a script defining its own
+  auto libm = ExitOnErr(engine->compile("extern sin(x);\n"
+                                        "def s(x) sin(x);\n"));
+  if (ExitOnErr(engine->lookup<double(double)>("s"))(0) != 0) {
+    std::cerr << "Expected s to call the runtime's sin.\n";
+    return 1;
+  }
+
+  // a script's own sin comes before the runtime's, which cos still links to
+  auto own = ExitOnErr(engine->compile("def sin(x) x + 1;\n"
+                                       "extern cos(x);\n"
+                                       "def h(x) sin(x) * 2 + cos(0);\n"));
+  auto h = ExitOnErr(engine->lookup<double(double)>("h"));
+  if (h(1) != 5) {
+    std::cerr << "Expected h to call the script's sin and return 5, got "
+              << h(1) << ".\n";
+    return 1;
+  }
+
+  // a loop from a fractional start steps by adding, whose rounding decides
+  // when it ends, as does one from a whole start, even one whose bound and
+  // step are near 2^53
+  auto loops = ExitOnErr(engine->compile(
+      "def fractional() var n = 0 in\n"
+      "  (for i = 12.333333333333334, i < 126.33333333333334, 2 in\n"
+      "    n = n + 1) + n;\n"
+      "def whole() var n = 0 in (for i = 3, i < 126, 2 in n = n + 1) + n;\n"
+      "def wide() var n = 0 in\n"
+      "  (for i = 0, i < 9007199254740991, 4503599627370496 in\n"
+      "    n = n + 1) + n;\n"
+      "def near(bound) var n = 0 in\n"
+      "  (for i = 0, i < bound, 1000000000000 in n = n + 1) + n;\n"));
+  auto runs = [](double start, double end, double step) {
+    double n = 0;
+    for (double i = start;; i += step) {
+      ++n;
+      if (!(i < end))
+        return n;
+    }
+  };
+  auto fractional = ExitOnErr(engine->lookup<double()>("fractional"));
+  auto whole = ExitOnErr(engine->lookup<double()>("whole"));
+  if (fractional() != runs(12.333333333333334, 126.33333333333334, 2) ||
+      whole() != runs(3, 126, 2)) {
+    std::cerr << "Expected the loops to run "
+              << runs(12.333333333333334, 126.33333333333334, 2) << " and "
+              << runs(3, 126, 2) << " times, not " << fractional() << " and "
+              << whole() << ".\n";
+    return 1;
+  }
+  auto wide = ExitOnErr(engine->lookup<double()>("wide"));
+  auto near = ExitOnErr(engine->lookup<double(double)>("near"));
+  auto wide_runs = runs(0, 9007199254740991, 0x1p52);
+  auto near_runs = runs(0, 9007199254740000, 1e12);
+  if (wide() != wide_runs || near(9007199254740000) != near_runs) {
+    std::cerr << "Expected the loops near 2^53 to run " << wide_runs << " and "
+              << near_runs << " times, not " << wide() << " and "
+              << near(9007199254740000) << ".\n";
+    return 1;
+  }
+  return 0;
+}
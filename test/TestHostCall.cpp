@@ -0,0 +1,59 @@
+#include "kaleidoscope/compiler/HostCall.hpp"
+#include "kaleidoscope/compiler/Lexer.hpp"
+#include "kaleidoscope/compiler/Parser.hpp"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/TargetSelect.h"
+#include <iostream>
+#include <vector>
+
+static char const source[] =
+    "def scale(xs[] k) for i = 0, i < len(xs) - 1 in xs[i] = xs[i] * k;\n"
+    "def sumfrom(xs[] i)\n"
+    "  if i < len(xs) then xs[i] + sumfrom(xs, i + 1) else 0;\n"
+    "def dot(xs[] ys[]) dotfrom(xs, ys, 0);\n"
+    "def dotfrom(xs[] ys[] i)\n"
+    "  if i < len(xs) then xs[i] * ys[i] + dotfrom(xs, ys, i + 1) else 0;\n";
+
+int main() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::ExitOnError ExitOnErr;
+
+  auto jit = ExitOnErr(llvm::orc::LLJITBuilder().create());
+  SignatureTable signatures;
+  CodegenContext ctx(jit.get(), &signatures);
+  Lexer lexer(source);
+  Parser parser;
+  ast::Arena arena;
+  // dot calls dotfrom before it's defined
+  signatures[Symbol::intern("dotfrom")] = Signature{3, 0b11};
+  for (auto ast = parser.parse(lexer, arena); ast;
+       ast = parser.parse_statement())
+    ast->codegen(ctx);
+  ctx.optimize(3);
+  ExitOnErr(jit->addIRModule(ctx.take_module()));
+
+  auto lookup = [&](char const *name) {
+    auto symbol = ExitOnErr(jit->lookup(name));
+    return symbol.toPtr<void *>();
+  };
+
+  std::vector<double> xs = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  auto data = xs.data();
+  call(lookup("scale"), xs, 2);
+  if (xs.data() != data || xs.front() != 2 || xs.back() != 22) {
+    std::cerr << "scale didn't scale the vector in place.\n";
+    return 1;
+  }
+
+  std::vector<double> ys(xs.size(), 0.5);
+  auto sum = call(lookup("sumfrom"), xs, 0.0);
+  auto dot = call(lookup("dot"), xs, ys);
+  if (sum != 132 || dot != 66) {
+    std::cerr << "Expected sum 132 and dot 66, got " << sum << " and " << dot
+              << ".\n";
+    return 1;
+  }
+  return 0;
+}
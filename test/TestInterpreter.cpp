@@ -0,0 +1,164 @@
+#include "kaleidoscope/compiler/Bytecode.hpp"
+#include "kaleidoscope/compiler/Interpreter.hpp"
+#include "kaleidoscope/compiler/Lexer.hpp"
+#include "kaleidoscope/compiler/Parser.hpp"
+#include "kaleidoscope/compiler/Runtime.hpp"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/TargetSelect.h"
+#include <iostream>
+#include <vector>
+
+static char const source[] =
+    "extern sin(x);\n"
+    "def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);\n"
+    "def count(n acc) if n < 1 then acc else count(n - 1, acc + 1);\n"
+    "def sum(n) var s = 0 in (for i = 0, i < n in s = s + i) + s;\n"
+    "def twice(x) later(later(x));\n"
+    "def later(x) x * 2;\n"
+    "fib(20);\n"
+    "count(1000000, 0);\n"
+    "sum(100);\n"
+    "twice(3);\n"
+    "sin(0);\n"
+    "def later(x) x * 3;\n"
+    "twice(3);\n";
+
+static std::vector<double> const expected = {6765, 1000000, 5050, 12, 0, 12};
+
+static bytecode::Program lower(char const *source) {
+  bytecode::Program program;
+  bytecode::Writer writer(program);
+  Lexer lexer(source);
+  Parser parser;
+  ast::Arena arena;
+  for (auto ast = parser.parse(lexer, arena); ast;
+       ast = parser.parse_statement())
+    writer.add(*ast);
+  writer.finish();
+  return program;
+}
+
+// run every expression, reporting the first that isn't as expected
+static bool check(bytecode::Program const &program, Interpreter &interpreter,
+                  char const *how) {
+  for (size_t i = 0; i < expected.size(); ++i) {
+    auto result = interpreter.run(program.expressions[i]);
+    if (result != expected[i]) {
+      std::cerr << how << ", expression " << i << " evaluated to " << result
+                << " instead of " << expected[i] << ".\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+int main() {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::ExitOnError ExitOnErr;
+
+  // through the encoding, as it would be cached
+  std::string encoded;
+  llvm::raw_string_ostream out(encoded);
+  bytecode::write(lower(source), out);
+  auto program = ExitOnErr(bytecode::read(out.str()));
+  if (program.expressions.size() != expected.size()) {
+    std::cerr << "Expected " << expected.size() << " expressions, got "
+              << program.expressions.size() << ".\n";
+    return 1;
+  }
+
+  Interpreter interpreted(program);
+  ExitOnErr(interpreted.link());
+  if (!check(program, interpreted, "Interpreted"))
+    return 1;
+
+  // fib and what it reaches are compiled partway through its first run
+  auto jit = ExitOnErr(llvm::orc::LLJITBuilder().create());
+  ExitOnErr(link_runtime(*jit));
+  SignatureTable signatures;
+  unsigned compiles = 0;
+  Interpreter handed_off(
+      program, 3,
+      [&](llvm::ArrayRef<uint32_t> functions)
+          -> llvm::Expected<std::vector<void *>> {
+        ++compiles;
+        CodegenContext ctx(jit.get(), &signatures);
+        bytecode::codegen(program, functions, ctx);
+        if (auto err = jit->addIRModule(ctx.take_module()))
+          return std::move(err);
+        std::vector<void *> addresses;
+        for (auto f : functions) {
+          auto symbol = jit->lookup(program.symbol(f));
+          if (!symbol)
+            return symbol.takeError();
+          addresses.push_back(symbol->toPtr<void *>());
+        }
+        return addresses;
+      });
+  ExitOnErr(handed_off.link());
+  if (!check(program, handed_off, "Jitted") || compiles == 0)
+    return 1;
+
+  // externs that nothing calls, like one declaring a later definition, don't
+  // have to be found
+  auto declared = lower("extern odd(n);\n"
+                        "extern nowhere(x);\n"
+                        "extern many(a b c d e f g);\n"
+                        "def even(n) if n < 1 then 1 else odd(n - 1);\n"
+                        "def odd(n) if n < 1 then 0 else even(n - 1);\n"
+                        "even(10);\n");
+  Interpreter unlinked(declared);
+  ExitOnErr(unlinked.link());
+  if (unlinked.run(declared.expressions[0]) != 1) {
+    std::cerr << "Expected even(10) to be 1.\n";
+    return 1;
+  }
+
+  // arrays are left to the jit
+  try {
+    lower("def first(xs[]) xs[0];");
+    std::cerr << "Expected a function of an array to be unsupported.\n";
+    return 1;
+  } catch (bytecode::Unsupported const &) {
+  }
+
+  auto truncated = bytecode::read(llvm::StringRef(out.str()).drop_back());
+  if (truncated) {
+    std::cerr << "Expected truncated bytecode to be rejected.\n";
+    return 1;
+  }
+  llvm::consumeError(truncated.takeError());
+
+  // a frame too large to allocate is rejected as malformed
+  auto huge = declared;
+  huge.functions.back().slots = 0xffffffff;
+  std::string huge_encoded;
+  llvm::raw_string_ostream huge_out(huge_encoded);
+  bytecode::write(huge, huge_out);
+  auto too_many_slots = bytecode::read(huge_out.str());
+  if (too_many_slots) {
+    std::cerr << "Expected a function of 2^32 - 1 slots to be rejected.\n";
+    return 1;
+  }
+  llvm::consumeError(too_many_slots.takeError());
+
+  // a program cached as simplified isn't used unsimplified
+  llvm::SmallString<128> directory;
+  if (llvm::sys::fs::createUniqueDirectory("bytecode", directory)) {
+    std::cerr << "Failed to create a cache directory.\n";
+    return 1;
+  }
+  bytecode::store_cached(directory, source, true, program);
+  auto simplified = bytecode::load_cached(directory, source, true);
+  auto unsimplified = bytecode::load_cached(directory, source, false);
+  llvm::sys::fs::remove_directories(directory);
+  if (!simplified || unsimplified) {
+    std::cerr << "Expected the program cached as simplified to be loaded "
+                 "only as that.\n";
+    return 1;
+  }
+  return 0;
+}
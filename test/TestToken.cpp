@@ -1,3 +1,4 @@
+#include "kaleidoscope/compiler/Lexer.hpp"
 #include "kaleidoscope/compiler/Token.hpp"
 #include <functional>
 #include <initializer_list>
@@ -6,16 +7,11 @@
 
 #include <sstream>
 
-int test_tokenize(std::string code, std::vector<Token> expected) {
-  std::istringstream s(code);
-  Token t;
-  std::vector<Token> actual;
-  while (s >> t) {
-    actual.push_back(t);
-  }
-
+int compare_tokens(char const *lexer, std::vector<Token> const &actual,
+                   std::vector<Token> const &expected) {
   if (actual != expected) {
-    std::cerr << "Mismatch between actual and expected tokens.\n";
+    std::cerr << "Mismatch between actual and expected tokens from " << lexer
+              << ".\n";
     std::cerr << "Actual:  ";
     auto sep = "";
     for (auto t : actual) {
@@ -25,7 +21,7 @@ int test_tokenize(std::string code, std::vector<Token> expected) {
     std::cerr << "\nExpected:";
     sep = "";
     for (auto t : expected) {
-      std::cerr << t << sep;
+      std::cerr << sep << t;
       sep = ", ";
     }
     std::cerr << "\n";
@@ -34,6 +30,35 @@ int test_tokenize(std::string code, std::vector<Token> expected) {
   return 0;
 }
 
+int test_stream(std::string const &code, std::vector<Token> const &expected) {
+  std::istringstream s(code);
+  Token t;
+  std::vector<Token> actual;
+  while (s >> t) {
+    actual.push_back(t);
+  }
+  return compare_tokens("operator>>", actual, expected);
+}
+
+int test_lexer(std::string const &code, std::vector<Token> const &expected) {
+  Lexer lexer(code);
+  std::vector<Token> actual;
+  for (auto t = lexer.next(); t.type != Token::TypeEOF; t = lexer.next()) {
+    // literals have to point into the source
+    if (t.literal.data() != code.data() + t.offset) {
+      std::cerr << "Token " << t.to_token() << " is not at offset " << t.offset
+                << ".\n";
+      return 1;
+    }
+    actual.push_back(t.to_token());
+  }
+  return compare_tokens("Lexer", actual, expected);
+}
+
+int test_tokenize(std::string code, std::vector<Token> expected) {
+  return test_stream(code, expected) | test_lexer(code, expected);
+}
+
 std::unordered_map<std::string, std::function<int()>> const tests = {
     {"Number",
      []() {
@@ -42,6 +67,38 @@ std::unordered_map<std::string, std::function<int()>> const tests = {
        };
        return test_tokenize("1.0", expected);
      }},
+    {"Operators",
+     []() {
+       auto expected = std::vector<Token>{
+           {Token::TypeNumber, ".5", .5},     {Token::TypeOperator, "<=", 0},
+           {Token::TypeNumber, "2.", 2},      {Token::TypeSemicolon, ";", 0},
+           {Token::TypeIdentifier, "x1", 0},  {Token::TypeOperator, "+", 0},
+           {Token::TypeLpar, "(", 0},         {Token::TypeIdentifier, "y", 0},
+           {Token::TypeComma, ",", 0},        {Token::TypeNumber, "10", 10},
+           {Token::TypeRpar, ")", 0},         {Token::TypeOperator, "!", 0},
+       };
+       return test_tokenize(".5<=2.;\n\tx1 + (y,10) !", expected);
+     }},
+    {"Brackets",
+     []() {
+       auto expected = std::vector<Token>{
+           {Token::TypeIdentifier, "xs", 0}, {Token::TypeLbracket, "[", 0},
+           {Token::TypeIdentifier, "i", 0},  {Token::TypeRbracket, "]", 0},
+           {Token::TypeOperator, "=", 0},    {Token::TypeOperator, "-", 0},
+           {Token::TypeLbracket, "[", 0},    {Token::TypeRbracket, "]", 0},
+       };
+       return test_tokenize("xs[i]= -[]", expected);
+     }},
+    {"Var",
+     []() {
+       auto expected = std::vector<Token>{
+           {Token::TypeVar, "var", 0},        {Token::TypeIdentifier, "x", 0},
+           {Token::TypeOperator, "=", 0},     {Token::TypeNumber, "1", 1},
+           {Token::TypeComma, ",", 0},        {Token::TypeIdentifier, "vars", 0},
+           {Token::TypeIn, "in", 0},          {Token::TypeIdentifier, "x", 0},
+       };
+       return test_tokenize("var x = 1, vars in x", expected);
+     }},
     {"Function",
      []() {
        // Example code from
@@ -52,13 +109,13 @@ std::unordered_map<std::string, std::function<int()>> const tests = {
            {Token::TypeLpar, "(", 0},
            {Token::TypeIdentifier, "x", 0},
            {Token::TypeRpar, ")", 0},
-           {Token::TypeIdentifier, "if", 0},
+           {Token::TypeIf, "if", 0},
            {Token::TypeIdentifier, "x", 0},
            {Token::TypeOperator, "<", 0},
            {Token::TypeNumber, "3", 3},
-           {Token::TypeIdentifier, "then", 0},
+           {Token::TypeThen, "then", 0},
            {Token::TypeNumber, "1", 1},
-           {Token::TypeIdentifier, "else", 0},
+           {Token::TypeElse, "else", 0},
            {Token::TypeIdentifier, "fib", 0},
            {Token::TypeLpar, "(", 0},
            {Token::TypeIdentifier, "x", 0},
@@ -80,6 +137,35 @@ std::unordered_map<std::string, std::function<int()>> const tests = {
                             "    fib(x-1)+fib(x-2)\n",
                             expected);
      }},
+    {"Locations",
+     []() {
+       std::string code = "def f(x)\n"
+                          "  x +\n"
+                          "\t\t1;";
+       std::vector<std::pair<unsigned, unsigned>> expected = {
+           {1, 1}, {1, 5}, {1, 6}, {1, 7}, {1, 8},
+           {2, 3}, {2, 5}, {3, 3}, {3, 4}, {3, 5},
+       };
+       Lexer lexer(code);
+       for (auto [line, column] : expected) {
+         auto t = lexer.next();
+         if (t.location.line != line || t.location.column != column) {
+           std::cerr << "Token " << t.to_token() << " is at "
+                     << t.location.line << ":" << t.location.column
+                     << ", not " << line << ":" << column << ".\n";
+           return 1;
+         }
+       }
+
+       // starting partway keeps counting from the start of the source
+       auto t = Lexer(code, code.find('+')).next();
+       if (t.location.line != 2 || t.location.column != 5) {
+         std::cerr << "Token " << t.to_token() << " is at " << t.location.line
+                   << ":" << t.location.column << ", not 2:5.\n";
+         return 1;
+       }
+       return 0;
+     }},
 };
 
 int main(int argc, char *argv[]) {
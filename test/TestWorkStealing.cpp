@@ -0,0 +1,28 @@
+#include "kaleidoscope/compiler/WorkStealing.hpp"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+int main() {
+  for (unsigned threads : {1, 2, 3, 8}) {
+    for (size_t count : {0, 1, 2, 7, 1000}) {
+      std::vector<std::atomic<int>> calls(count);
+      parallel_for(count, threads, [&](size_t i) {
+        // the first few are slow, to leave something for the others to steal
+        if (i < 4)
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ++calls[i];
+      });
+      for (size_t i = 0; i < count; ++i) {
+        if (calls[i] != 1) {
+          std::cerr << "With " << threads << " threads and " << count
+                    << " indices, " << i << " was done " << calls[i]
+                    << " times.\n";
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}